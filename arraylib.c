@@ -0,0 +1,370 @@
+#include <math.h>
+#include <string.h>
+
+#include "arraylib.h"
+#include "memory.h"
+#include "vm.h"
+
+typedef bool (*ArrayMethod)(ObjArray* array, int argumentCount, Value* arguments, Value* result);
+
+typedef struct {
+    const char* name;
+    int minArity;
+    int maxArity;
+    ArrayMethod method;
+} ArrayMethodEntry;
+
+// Below this many elements a partition is finished by insertion sort
+#define SORT_INSERTION_LENGTH 16
+
+static bool indexArgument(Value value, size_t limit, const char* method, size_t* index) {
+    // An index from 0 to limit inclusive
+    if (!IS_NUMBER(value) || AS_NUMBER(value) != floor(AS_NUMBER(value)) ||
+        AS_NUMBER(value) < 0 || AS_NUMBER(value) > (double) limit) {
+        runtimeError("Index passed into %s must be an integer from 0 to %zu", method, limit);
+        return false;
+    }
+    *index = (size_t) AS_NUMBER(value);
+    return true;
+}
+
+static ObjArray* pushNewArray(size_t capacity) {
+    // Left on the stack, the caller pops it once it is filled
+    ObjArray* array = newArray(NULL, 0);
+    push(OBJ_VAL(array));
+    reserveValueArray(&array->valueArray, capacity);
+    return array;
+}
+
+static bool callBack(Value function, int argumentCount, Value* arguments) {
+    // Leaves the result on the stack
+    push(function);
+    for (int i = 0; i < argumentCount; i++) push(arguments[i]);
+    return callFunction(argumentCount);
+}
+
+typedef struct {
+    ObjArray* array;
+    Value comparator; // nil for the natural order of numbers or strings
+    size_t count; // The comparator must not change the array under the sort
+} Sort;
+
+static bool compare(Sort* sort, ptrdiff_t a, ptrdiff_t b, bool* less) {
+    Value* values = sort->array->valueArray.values;
+    if (IS_NIL(sort->comparator)) {
+        if (IS_NUMBER(values[a])) {
+            *less = AS_NUMBER(values[a]) < AS_NUMBER(values[b]);
+        } else {
+            ObjString* aString = AS_STRING(values[a]);
+            ObjString* bString = AS_STRING(values[b]);
+            int length = aString->length < bString->length ? aString->length : bString->length;
+            int order = memcmp(stringChars(aString), stringChars(bString), length);
+            *less = order < 0 || (order == 0 && aString->length < bString->length);
+        }
+        return true;
+    }
+
+    Value pair[2] = {values[a], values[b]};
+    if (!callBack(sort->comparator, 2, pair)) return false;
+    Value order = pop();
+    if (!IS_NUMBER(order)) {
+        runtimeError("Comparator passed into sort must return a number");
+        return false;
+    }
+    if (sort->array->valueArray.count != sort->count) {
+        runtimeError("Array changed while it was being sorted");
+        return false;
+    }
+    *less = AS_NUMBER(order) < 0;
+    return true;
+}
+
+static void swap(Sort* sort, ptrdiff_t a, ptrdiff_t b) {
+    // Every value stays in the array while the comparator runs, so all of them stay reachable
+    Value* values = sort->array->valueArray.values;
+    Value value = values[a];
+    values[a] = values[b];
+    values[b] = value;
+}
+
+static bool insertionSort(Sort* sort, ptrdiff_t start, ptrdiff_t end) {
+    for (ptrdiff_t i = start + 1; i < end; i++) {
+        for (ptrdiff_t j = i; j > start; j--) {
+            bool less;
+            if (!compare(sort, j, j - 1, &less)) return false;
+            if (!less) break;
+            swap(sort, j, j - 1);
+        }
+    }
+    return true;
+}
+
+static bool siftDown(Sort* sort, ptrdiff_t start, ptrdiff_t root, ptrdiff_t end) {
+    while (true) {
+        ptrdiff_t child = start + 2 * (root - start) + 1;
+        if (child >= end) return true;
+        bool less;
+        if (child + 1 < end) {
+            if (!compare(sort, child, child + 1, &less)) return false;
+            if (less) child++;
+        }
+        if (!compare(sort, root, child, &less)) return false;
+        if (!less) return true;
+        swap(sort, root, child);
+        root = child;
+    }
+}
+
+static bool heapSort(Sort* sort, ptrdiff_t start, ptrdiff_t end) {
+    for (ptrdiff_t root = start + (end - start) / 2 - 1; root >= start; root--) {
+        if (!siftDown(sort, start, root, end)) return false;
+    }
+    for (ptrdiff_t last = end - 1; last > start; last--) {
+        swap(sort, start, last);
+        if (!siftDown(sort, start, start, last)) return false;
+    }
+    return true;
+}
+
+static bool medianToStart(Sort* sort, ptrdiff_t start, ptrdiff_t end) {
+    // The median of the first, middle and last elements becomes the pivot at start
+    ptrdiff_t middle = start + (end - start) / 2;
+    ptrdiff_t last = end - 1;
+    bool less;
+    if (!compare(sort, middle, start, &less)) return false;
+    if (less) swap(sort, middle, start);
+    if (!compare(sort, last, middle, &less)) return false;
+    if (less) {
+        swap(sort, last, middle);
+        if (!compare(sort, middle, start, &less)) return false;
+        if (less) swap(sort, middle, start);
+    }
+    swap(sort, start, middle);
+    return true;
+}
+
+static bool introSort(Sort* sort, ptrdiff_t start, ptrdiff_t end, int depthLimit) {
+    // Quicksort, falling back to heap sort when partitions keep coming out lopsided
+    while (end - start > SORT_INSERTION_LENGTH) {
+        if (depthLimit-- == 0) return heapSort(sort, start, end);
+        if (!medianToStart(sort, start, end)) return false;
+
+        // Hoare partition around the pivot at start
+        ptrdiff_t i = start;
+        ptrdiff_t j = end;
+        while (true) {
+            bool less;
+            do {
+                if (++i == end) break;
+                if (!compare(sort, i, start, &less)) return false;
+            } while (less);
+            do {
+                // A comparator that calls the pivot less than itself would walk j off the front
+                if (--j == start) break;
+                if (!compare(sort, start, j, &less)) return false;
+            } while (less);
+            if (i >= j) break;
+            swap(sort, i, j);
+        }
+        swap(sort, start, j);
+
+        // Recursing into the smaller side bounds the C stack by log n
+        if (j - start < end - j - 1) {
+            if (!introSort(sort, start, j, depthLimit)) return false;
+            start = j + 1;
+        } else {
+            if (!introSort(sort, j + 1, end, depthLimit)) return false;
+            end = j;
+        }
+    }
+    return insertionSort(sort, start, end);
+}
+
+static bool sortMethod(ObjArray* array, int argumentCount, Value* arguments, Value* result) {
+    // Sorts in place. Without a comparator every element must be a number, or every one a string
+    Sort sort = {array, argumentCount == 1 ? arguments[0] : NIL_VAL, array->valueArray.count};
+    if (IS_NIL(sort.comparator) && sort.count > 0) {
+        Value* values = array->valueArray.values;
+        bool numbers = IS_NUMBER(values[0]);
+        for (size_t i = 0; i < sort.count; i++) {
+            if (numbers ? !IS_NUMBER(values[i]) : !IS_STRING(values[i])) {
+                runtimeError("Without a comparator sort needs all numbers or all strings");
+                return false;
+            }
+        }
+    }
+
+    int depthLimit = 0;
+    for (size_t n = sort.count; n > 1; n >>= 1) depthLimit += 2;
+    if (!introSort(&sort, 0, sort.count, depthLimit)) return false;
+    *result = OBJ_VAL(array);
+    return true;
+}
+
+static bool mapMethod(ObjArray* array, int argumentCount, Value* arguments, Value* result) {
+    // Only the elements there at the start are visited, so a function that appends still finishes
+    size_t count = array->valueArray.count;
+    ObjArray* mapped = pushNewArray(count);
+    for (size_t i = 0; i < count && i < array->valueArray.count; i++) {
+        if (!callBack(arguments[0], 1, &array->valueArray.values[i])) return false;
+        writeValueArray(&mapped->valueArray, vm.stackTop[-1]);
+        pop();
+    }
+    *result = pop();
+    return true;
+}
+
+static bool filterMethod(ObjArray* array, int argumentCount, Value* arguments, Value* result) {
+    size_t count = array->valueArray.count;
+    ObjArray* filtered = pushNewArray(0);
+    for (size_t i = 0; i < count && i < array->valueArray.count; i++) {
+        // Kept on the stack in case the function replaces it in the array
+        push(array->valueArray.values[i]);
+        if (!callBack(arguments[0], 1, &vm.stackTop[-1])) return false;
+        Value keep = pop();
+        if (!IS_NIL(keep) && !(IS_BOOL(keep) && !AS_BOOL(keep))) {
+            writeValueArray(&filtered->valueArray, vm.stackTop[-1]);
+        }
+        pop();
+    }
+    *result = pop();
+    return true;
+}
+
+static bool reduceMethod(ObjArray* array, int argumentCount, Value* arguments, Value* result) {
+    // reduce(function, initial). Without an initial value the first element starts it off
+    size_t start = 0;
+    size_t count = array->valueArray.count;
+    if (argumentCount == 2) {
+        push(arguments[1]);
+    } else if (count == 0) {
+        runtimeError("Cannot reduce an empty array without an initial value");
+        return false;
+    } else {
+        push(array->valueArray.values[start++]);
+    }
+    for (size_t i = start; i < count && i < array->valueArray.count; i++) {
+        // The accumulator stays on the stack under the call
+        Value pair[2] = {vm.stackTop[-1], array->valueArray.values[i]};
+        if (!callBack(arguments[0], 2, pair)) return false;
+        vm.stackTop[-2] = vm.stackTop[-1];
+        pop();
+    }
+    *result = pop();
+    return true;
+}
+
+static bool sliceMethod(ObjArray* array, int argumentCount, Value* arguments, Value* result) {
+    // slice(start, end), end defaults to the length
+    size_t count = array->valueArray.count;
+    size_t start;
+    size_t end = count;
+    if (!indexArgument(arguments[0], count, "slice", &start)) return false;
+    if (argumentCount == 2 && !indexArgument(arguments[1], count, "slice", &end)) return false;
+    if (end < start) end = start;
+
+    ObjArray* slice = pushNewArray(end - start);
+    // An empty array has no storage to copy to or from
+    if (end > start) {
+        memcpy(slice->valueArray.values, array->valueArray.values + start, sizeof(Value) * (end - start));
+    }
+    slice->valueArray.count = end - start;
+    *result = pop();
+    return true;
+}
+
+static bool concatMethod(ObjArray* array, int argumentCount, Value* arguments, Value* result) {
+    if (!IS_ARRAY(arguments[0])) {
+        runtimeError("Argument of concat must be an array");
+        return false;
+    }
+    ValueArray* other = &AS_ARRAY(arguments[0])->valueArray;
+    size_t count = array->valueArray.count;
+    ObjArray* joined = pushNewArray(count + other->count);
+    if (count > 0) memcpy(joined->valueArray.values, array->valueArray.values, sizeof(Value) * count);
+    if (other->count > 0) memcpy(joined->valueArray.values + count, other->values, sizeof(Value) * other->count);
+    joined->valueArray.count = count + other->count;
+    *result = pop();
+    return true;
+}
+
+static bool reverseMethod(ObjArray* array, int argumentCount, Value* arguments, Value* result) {
+    // In place
+    Value* values = array->valueArray.values;
+    size_t count = array->valueArray.count;
+    for (size_t i = 0; i < count / 2; i++) {
+        Value value = values[i];
+        values[i] = values[count - 1 - i];
+        values[count - 1 - i] = value;
+    }
+    *result = OBJ_VAL(array);
+    return true;
+}
+
+static bool indexOfMethod(ObjArray* array, int argumentCount, Value* arguments, Value* result) {
+    // indexOf(value, from), -1 if it is not there
+    size_t from = 0;
+    if (argumentCount == 2 && !indexArgument(arguments[1], array->valueArray.count, "indexOf", &from)) return false;
+    *result = NUMBER_VAL(-1);
+    for (size_t i = from; i < array->valueArray.count; i++) {
+        if (valuesEqual(array->valueArray.values[i], arguments[0])) {
+            *result = NUMBER_VAL(i);
+            break;
+        }
+    }
+    return true;
+}
+
+static bool fillMethod(ObjArray* array, int argumentCount, Value* arguments, Value* result) {
+    // fill(value, start, end) in place, the range defaults to the whole array
+    size_t count = array->valueArray.count;
+    size_t start = 0;
+    size_t end = count;
+    if (argumentCount >= 2 && !indexArgument(arguments[1], count, "fill", &start)) return false;
+    if (argumentCount == 3 && !indexArgument(arguments[2], count, "fill", &end)) return false;
+    for (size_t i = start; i < end; i++) array->valueArray.values[i] = arguments[0];
+    *result = OBJ_VAL(array);
+    return true;
+}
+
+static const ArrayMethodEntry arrayMethods[] = {
+    {"sort", 0, 1, sortMethod},
+    {"map", 1, 1, mapMethod},
+    {"filter", 1, 1, filterMethod},
+    {"reduce", 1, 2, reduceMethod},
+    {"slice", 1, 2, sliceMethod},
+    {"concat", 1, 1, concatMethod},
+    {"reverse", 0, 0, reverseMethod},
+    {"indexOf", 1, 2, indexOfMethod},
+    {"fill", 1, 3, fillMethod},
+};
+
+void initArrayMethods() {
+    for (int i = 0; i < (int) (sizeof(arrayMethods) / sizeof(arrayMethods[0])); i++) {
+        ObjString* name = copyString((char*) arrayMethods[i].name, (int) strlen(arrayMethods[i].name));
+        push(OBJ_VAL(name));
+        tableSet(&vm.arrayMethods, name, NUMBER_VAL(i));
+        pop();
+    }
+}
+
+bool invokeArrayMethod(ObjString* name, int argumentCount) {
+    Value index;
+    if (!tableGet(&vm.arrayMethods, name, &index)) {
+        runtimeError("Array does not have method %s", name->chars);
+        return false;
+    }
+    const ArrayMethodEntry* entry = &arrayMethods[(int) AS_NUMBER(index)];
+    if (argumentCount < entry->minArity || argumentCount > entry->maxArity) {
+        runtimeError("Incorrect number of arguments passed into %s", entry->name);
+        return false;
+    }
+
+    // The receiver and arguments stay on the stack while the method allocates or calls back
+    Value* arguments = vm.stackTop - argumentCount;
+    Value result;
+    if (!entry->method(AS_ARRAY(arguments[-1]), argumentCount, arguments, &result)) return false;
+    vm.stackTop = arguments;
+    vm.stackTop[-1] = result;
+    return true;
+}
@@ -0,0 +1,15 @@
+//
+// Created by Yuriy Kulinchenko on 18/10/2026.
+//
+
+#ifndef clox_arraylib_h
+#define clox_arraylib_h
+
+#include "common.h"
+#include "object.h"
+
+void initArrayMethods();
+// The receiver and arguments are on the stack, the result replaces the receiver
+bool invokeArrayMethod(ObjString* name, int argumentCount);
+
+#endif
@@ -0,0 +1,697 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "memory.h"
+#include "vm.h"
+
+// Bump whenever OpCode or the layout below changes, older files are then ignored
+#define CACHE_FORMAT_VERSION 8
+#define CACHE_ENDIAN_CHECK 0x01020304u
+
+// Layout, integers in native byte order:
+//   header:   "CLOXBC\0\0", u32 version, u32 endian check, u64 source hash, u64 source length,
+//             source chars, u32 function count
+//   function: u32 arity, u32 upvalue count, i32 name length (-1 for the script) + chars,
+//             u32 constant count + constants, u32 code count + code,
+//             u32 line run count + runs of (i32 first offset, i32 line)
+//   constant: u8 tag, then a double, u32 length + chars, or u32 index of an earlier function
+// Nested functions are written before the function that refers to them, the script comes last.
+
+typedef enum {
+    CONSTANT_NUMBER,
+    CONSTANT_STRING,
+    CONSTANT_FUNCTION,
+} ConstantTag;
+
+typedef enum {
+    OPERAND_NONE,
+    OPERAND_BYTE,
+    OPERAND_CONSTANT,
+    OPERAND_STRING,
+    OPERAND_STRING_BYTE,
+    OPERAND_UPVALUE,
+    OPERAND_JUMP,
+    OPERAND_LOOP,
+    OPERAND_CLOSURE,
+    OPERAND_INVALID,
+} OperandKind;
+
+typedef struct {
+    int32_t needed; // Values the instruction reads off the top of the stack
+    int32_t effect; // Change in stack depth once it has run
+} StackEffect;
+
+typedef struct {
+    uint8_t* bytes;
+    size_t count;
+    size_t capacity;
+} Buffer;
+
+typedef struct {
+    const uint8_t* current;
+    const uint8_t* end;
+    bool valid;
+} Reader;
+
+static const char* cacheDirectory = NULL;
+
+void setCacheDirectory(const char* path) {
+    cacheDirectory = path;
+}
+
+static uint64_t hashSource(const char* source, size_t length) {
+    uint64_t hash = 14695981039346656037u;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (uint8_t) source[i];
+        hash *= 1099511628211u;
+    }
+    return hash;
+}
+
+static void cachePath(char* path, size_t size, uint64_t hash) {
+    snprintf(path, size, "%s/%016llx.loxc", cacheDirectory, (unsigned long long) hash);
+}
+
+static OperandKind operandKind(uint8_t instruction) {
+    switch (instruction) {
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_NIL:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_NEGATE:
+        case OP_RETURN:
+        case OP_NOT:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_PRINT:
+        case OP_POP:
+        case OP_GET_ARRAY:
+        case OP_SET_ARRAY:
+        case OP_APPEND:
+        case OP_CLOSE_UPVALUE:
+        case OP_INHERIT:
+            return OPERAND_NONE;
+        case OP_POP_COUNT:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_CALL:
+        case OP_CREATE_ARRAY:
+        case OP_CONCAT_N:
+        case OP_CHECK_ADDABLE:
+        case OP_DUPLICATE:
+            return OPERAND_BYTE;
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG:
+            return OPERAND_CONSTANT;
+        case OP_DEFINE_GLOBAL:
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_CLASS:
+        case OP_SET_PROPERTY:
+        case OP_GET_PROPERTY:
+        case OP_METHOD:
+        case OP_GET_SUPER:
+        case OP_IMPORT:
+            return OPERAND_STRING;
+        case OP_INVOKE:
+        case OP_SUPER_INVOKE:
+            return OPERAND_STRING_BYTE;
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+            return OPERAND_UPVALUE;
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP:
+            return OPERAND_JUMP;
+        case OP_LOOP:
+            return OPERAND_LOOP;
+        case OP_CLOSURE:
+            return OPERAND_CLOSURE;
+        default:
+            return OPERAND_INVALID;
+    }
+}
+
+static void writeRaw(Buffer* buffer, const void* bytes, size_t count) {
+    if (buffer->capacity < buffer->count + count) {
+        size_t capacity = buffer->capacity < 256 ? 256 : buffer->capacity;
+        while (capacity < buffer->count + count) capacity *= 2;
+        uint8_t* grown = realloc(buffer->bytes, capacity);
+        if (grown == NULL) exit(1);
+        buffer->bytes = grown;
+        buffer->capacity = capacity;
+    }
+    memcpy(buffer->bytes + buffer->count, bytes, count);
+    buffer->count += count;
+}
+
+static void writeU8(Buffer* buffer, uint8_t value) {
+    writeRaw(buffer, &value, sizeof(value));
+}
+
+static void writeU32(Buffer* buffer, uint32_t value) {
+    writeRaw(buffer, &value, sizeof(value));
+}
+
+static void writeU64(Buffer* buffer, uint64_t value) {
+    writeRaw(buffer, &value, sizeof(value));
+}
+
+static bool isFullyCompiled(ObjFunction* function) {
+    // Deferred bodies point into the source, so they cannot be written out
+    if (function->lazy != NULL) return false;
+    ValueArray* constants = &function->chunk.constants;
+    for (int i = 0; i < constants->count; i++) {
+        if (IS_FUNCTION(constants->values[i]) && !isFullyCompiled(AS_FUNCTION(constants->values[i]))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static uint32_t writeFunction(Buffer* buffer, ObjFunction* function, uint32_t* functionCount) {
+    Chunk* chunk = &function->chunk;
+    ValueArray* constants = &chunk->constants;
+
+    uint32_t* children = malloc(sizeof(uint32_t) * (constants->count + 1));
+    if (children == NULL) exit(1);
+    for (int i = 0; i < constants->count; i++) {
+        if (IS_FUNCTION(constants->values[i])) {
+            children[i] = writeFunction(buffer, AS_FUNCTION(constants->values[i]), functionCount);
+        }
+    }
+
+    writeU32(buffer, (uint32_t) function->arity);
+    writeU32(buffer, (uint32_t) function->upvalueCount);
+    if (function->name == NULL) {
+        writeU32(buffer, (uint32_t) -1);
+    } else {
+        writeU32(buffer, (uint32_t) function->name->length);
+        writeRaw(buffer, function->name->chars, function->name->length);
+    }
+
+    writeU32(buffer, (uint32_t) constants->count);
+    for (int i = 0; i < constants->count; i++) {
+        Value value = constants->values[i];
+        if (IS_NUMBER(value)) {
+            double number = AS_NUMBER(value);
+            writeU8(buffer, CONSTANT_NUMBER);
+            writeRaw(buffer, &number, sizeof(number));
+        } else if (IS_STRING(value)) {
+            ObjString* string = AS_STRING(value);
+            writeU8(buffer, CONSTANT_STRING);
+            writeU32(buffer, (uint32_t) string->length);
+            writeRaw(buffer, string->chars, string->length);
+        } else {
+            writeU8(buffer, CONSTANT_FUNCTION);
+            writeU32(buffer, children[i]);
+        }
+    }
+    free(children);
+
+    writeU32(buffer, (uint32_t) chunk->count);
+    writeRaw(buffer, chunk->code, chunk->count);
+    writeU32(buffer, (uint32_t) chunk->lineCount);
+    for (int i = 0; i < chunk->lineCount; i++) {
+        int32_t run[2] = {chunk->lines[i].offset, chunk->lines[i].line};
+        writeRaw(buffer, run, sizeof(run));
+    }
+
+    return (*functionCount)++;
+}
+
+void storeCachedFunction(const char* source, ObjFunction* function) {
+    if (cacheDirectory == NULL || !isFullyCompiled(function)) return;
+
+    size_t sourceLength = strlen(source);
+    uint64_t hash = hashSource(source, sourceLength);
+    Buffer buffer = {.bytes = NULL, .count = 0, .capacity = 0};
+
+    writeRaw(&buffer, "CLOXBC\0\0", 8);
+    writeU32(&buffer, CACHE_FORMAT_VERSION);
+    writeU32(&buffer, CACHE_ENDIAN_CHECK);
+    writeU64(&buffer, hash);
+    writeU64(&buffer, sourceLength);
+    writeRaw(&buffer, source, sourceLength);
+    size_t countOffset = buffer.count;
+    writeU32(&buffer, 0);
+
+    uint32_t functionCount = 0;
+    writeFunction(&buffer, function, &functionCount);
+    memcpy(buffer.bytes + countOffset, &functionCount, sizeof(functionCount));
+
+    // Written beside the final name and renamed, so readers never see a partial file
+    char path[4096];
+    char temporaryPath[4096 + 32];
+    cachePath(path, sizeof(path), hash);
+    snprintf(temporaryPath, sizeof(temporaryPath), "%s.%d.tmp", path, (int) getpid());
+    mkdir(cacheDirectory, 0755);
+
+    FILE* file = fopen(temporaryPath, "wb");
+    if (file != NULL) {
+        bool written = fwrite(buffer.bytes, 1, buffer.count, file) == buffer.count;
+        written = fclose(file) == 0 && written;
+        if (!written || rename(temporaryPath, path) != 0) remove(temporaryPath);
+    }
+    free(buffer.bytes);
+}
+
+static const uint8_t* readBytes(Reader* reader, size_t count) {
+    if (!reader->valid || (size_t) (reader->end - reader->current) < count) {
+        reader->valid = false;
+        return NULL;
+    }
+    const uint8_t* bytes = reader->current;
+    reader->current += count;
+    return bytes;
+}
+
+static uint8_t readU8(Reader* reader) {
+    const uint8_t* bytes = readBytes(reader, 1);
+    return bytes == NULL ? 0 : bytes[0];
+}
+
+static uint32_t readU32(Reader* reader) {
+    uint32_t value = 0;
+    const uint8_t* bytes = readBytes(reader, sizeof(value));
+    if (bytes != NULL) memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+static uint64_t readU64(Reader* reader) {
+    uint64_t value = 0;
+    const uint8_t* bytes = readBytes(reader, sizeof(value));
+    if (bytes != NULL) memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+static double readDouble(Reader* reader) {
+    double value = 0;
+    const uint8_t* bytes = readBytes(reader, sizeof(value));
+    if (bytes != NULL) memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+static uint32_t readOperand(const uint8_t* code, uint32_t offset, uint32_t width) {
+    if (width == 1) return code[offset];
+    if (width == 2) return (uint32_t) (code[offset] << 8 | code[offset + 1]);
+    return (uint32_t) (code[offset] << 16 | code[offset + 1] << 8 | code[offset + 2]);
+}
+
+static StackEffect stackEffect(uint8_t instruction, int32_t operand) {
+    // Counts come from the operand, the argument count of an invoke from the byte after it
+    switch (instruction) {
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_NIL:
+        case OP_GET_GLOBAL:
+        case OP_GET_LOCAL:
+        case OP_GET_UPVALUE:
+        case OP_DUPLICATE:
+        case OP_CLOSURE:
+        case OP_CLASS:
+            return (StackEffect) {0, 1};
+        case OP_NEGATE:
+        case OP_NOT:
+        case OP_SET_GLOBAL:
+        case OP_SET_LOCAL:
+        case OP_SET_UPVALUE:
+        case OP_GET_PROPERTY:
+        case OP_JUMP_IF_FALSE:
+            return (StackEffect) {1, 0};
+        case OP_RETURN:
+        case OP_PRINT:
+        case OP_POP:
+        case OP_DEFINE_GLOBAL:
+        case OP_CLOSE_UPVALUE:
+            return (StackEffect) {1, -1};
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_GET_ARRAY:
+        case OP_APPEND:
+        case OP_SET_PROPERTY:
+        case OP_METHOD:
+        case OP_INHERIT:
+        case OP_GET_SUPER:
+            return (StackEffect) {2, -1};
+        case OP_SET_ARRAY:
+            return (StackEffect) {3, -2};
+        case OP_POP_COUNT:
+            return (StackEffect) {operand, -operand};
+        case OP_CREATE_ARRAY:
+        case OP_CONCAT_N:
+            return (StackEffect) {operand, 1 - operand};
+        case OP_CALL:
+        case OP_INVOKE:
+            return (StackEffect) {operand + 1, -operand};
+        case OP_SUPER_INVOKE:
+            return (StackEffect) {operand + 2, -operand - 1};
+        default:
+            return (StackEffect) {0, 0};
+    }
+}
+
+static bool recordDepth(int32_t* depths, uint32_t offset, int32_t depth) {
+    // Every path into an instruction must arrive with the same stack depth
+    if (depths[offset] >= 0 && depths[offset] != depth) return false;
+    depths[offset] = depth;
+    return true;
+}
+
+static bool validateCode(const uint8_t* code, uint32_t count, uint32_t arity, const uint8_t* tags,
+                         const uint32_t* children, uint32_t constantCount, uint32_t upvalueCount,
+                         const uint32_t* upvalueCounts) {
+    if (count == 0) return false;
+
+    // Jump targets are checked against instruction starts once the whole chunk has been walked.
+    // The stack depth is followed along the way, from the callee and its arguments in the first
+    // slots, so local slots and counts can be checked against what is really on the stack. Code
+    // not reached yet has depth -1 and only its operands are checked. A for loop's increment is
+    // only reached by looping back to it, so the walk repeats while loops find such code
+    bool* starts = calloc(count + 1, sizeof(bool));
+    int32_t* depths = malloc(sizeof(int32_t) * (count + 1));
+    uint32_t* targets = malloc(sizeof(uint32_t) * count);
+    if (starts == NULL || depths == NULL || targets == NULL) exit(1);
+    for (uint32_t i = 0; i <= count; i++) depths[i] = -1;
+    uint32_t targetCount = 0;
+    bool valid = true;
+    bool walkAgain = true;
+    while (valid && walkAgain) {
+        walkAgain = false;
+        targetCount = 0;
+        int32_t depth = (int32_t) arity + 1;
+        uint32_t offset = 0;
+        while (valid && offset < count) {
+            starts[offset] = true;
+            if (depths[offset] >= 0 && depth < 0) depth = depths[offset];
+            if (depth >= 0 && !recordDepth(depths, offset, depth)) {
+                valid = false;
+                break;
+            }
+
+            uint8_t instruction = code[offset];
+            uint32_t operand = offset + 1;
+            uint32_t width = 1;
+            if (instruction == OP_WIDE) {
+                // The prefix widens the operand of the next instruction to 24 bits
+                instruction = operand < count ? code[operand] : OP_WIDE;
+                operand++;
+                width = 3;
+                if (instruction == OP_CONSTANT || instruction == OP_CONSTANT_LONG ||
+                    operandKind(instruction) == OPERAND_NONE) {
+                    valid = false;
+                    break;
+                }
+            } else if (instruction == OP_CONSTANT_LONG) {
+                width = 3;
+            }
+
+            uint32_t next = operand;
+            int32_t argument = 0;
+            switch (operandKind(instruction)) {
+                case OPERAND_NONE: break;
+                case OPERAND_BYTE:
+                    next += width;
+                    valid = next <= count;
+                    if (valid) argument = (int32_t) readOperand(code, operand, width);
+                    break;
+                case OPERAND_UPVALUE:
+                    next += width;
+                    valid = next <= count && readOperand(code, operand, width) < upvalueCount;
+                    break;
+                case OPERAND_CONSTANT:
+                    next += width;
+                    valid = next <= count && readOperand(code, operand, width) < constantCount;
+                    break;
+                case OPERAND_STRING:
+                case OPERAND_STRING_BYTE:
+                    next += operandKind(instruction) == OPERAND_STRING ? width : width + 1;
+                    valid = next <= count && readOperand(code, operand, width) < constantCount &&
+                        tags[readOperand(code, operand, width)] == CONSTANT_STRING;
+                    if (valid && operandKind(instruction) == OPERAND_STRING_BYTE) argument = code[next - 1];
+                    break;
+                case OPERAND_JUMP:
+                case OPERAND_LOOP: {
+                    if (width == 1) width = 2;
+                    next += width;
+                    if (next > count) {
+                        valid = false;
+                        break;
+                    }
+                    uint32_t jump = readOperand(code, operand, width);
+                    if (operandKind(instruction) == OPERAND_JUMP) {
+                        valid = next + jump <= count;
+                        targets[targetCount++] = next + jump;
+                        // The condition stays on the stack on both paths
+                        if (valid && depth >= 0) valid = recordDepth(depths, next + jump, depth);
+                    } else {
+                        valid = jump <= next;
+                        targets[targetCount++] = next - jump;
+                        if (valid && depth >= 0) {
+                            walkAgain = walkAgain || depths[next - jump] < 0;
+                            valid = recordDepth(depths, next - jump, depth);
+                        }
+                    }
+                    break;
+                }
+                case OPERAND_CLOSURE: {
+                    next += width;
+                    if (next > count || readOperand(code, operand, width) >= constantCount ||
+                        tags[readOperand(code, operand, width)] != CONSTANT_FUNCTION) {
+                        valid = false;
+                        break;
+                    }
+                    uint32_t captured = upvalueCounts[children[readOperand(code, operand, width)]];
+                    for (uint32_t i = 0; i < captured && valid; i++) {
+                        // Bit 0 marks a local, bit 1 a 24 bit index
+                        if (next >= count || code[next] > 3) {
+                            valid = false;
+                            break;
+                        }
+                        uint8_t flags = code[next];
+                        uint32_t indexWidth = flags & 2 ? 3 : 1;
+                        next += 1 + indexWidth;
+                        if (!(valid = next <= count)) break;
+                        uint32_t index = readOperand(code, next - indexWidth, indexWidth);
+                        valid = flags & 1 ? depth < 0 || index < (uint32_t) depth : index < upvalueCount;
+                    }
+                    break;
+                }
+                case OPERAND_INVALID: valid = false; break;
+            }
+
+            if (valid && depth >= 0) {
+                // Locals and duplicated values must already be on the stack, and nothing may read
+                // below the frame or push past the end of the VM stack
+                StackEffect stack = stackEffect(instruction, argument);
+                bool readsSlot = instruction == OP_GET_LOCAL || instruction == OP_SET_LOCAL ||
+                    instruction == OP_DUPLICATE || instruction == OP_CHECK_ADDABLE;
+                valid = depth >= stack.needed && depth + stack.effect <= STACK_MAX &&
+                    (!readsSlot || argument < depth);
+                depth += stack.effect;
+                // Nothing falls through a return, a jump or a loop
+                if (instruction == OP_RETURN || instruction == OP_JUMP || instruction == OP_LOOP) depth = -1;
+            }
+            offset = next;
+        }
+        // Running off the end of the code, by falling through or by a jump, would leave the chunk
+        valid = valid && offset == count && depth < 0 && depths[count] < 0;
+    }
+    starts[count] = true;
+    for (uint32_t i = 0; i < targetCount && valid; i++) {
+        valid = starts[targets[i]];
+    }
+
+    free(starts);
+    free(depths);
+    free(targets);
+    return valid;
+}
+
+static bool validateFunction(Reader* reader, uint32_t index, bool isScript, uint32_t* upvalueCounts) {
+    // The script is called with no arguments and captures nothing
+    uint32_t arity = readU32(reader);
+    if (arity > UINT8_MAX || (isScript && arity != 0)) return false;
+    uint32_t upvalueCount = readU32(reader);
+    if (upvalueCount > UINT16_COUNT || (isScript && upvalueCount != 0)) return false;
+    uint32_t nameLength = readU32(reader);
+    if (nameLength != (uint32_t) -1) readBytes(reader, nameLength);
+
+    uint32_t constantCount = readU32(reader);
+    if (!reader->valid || constantCount > (size_t) (reader->end - reader->current)) return false;
+    uint8_t* tags = malloc(constantCount + 1);
+    uint32_t* children = malloc(sizeof(uint32_t) * (constantCount + 1));
+    if (tags == NULL || children == NULL) exit(1);
+
+    bool valid = true;
+    for (uint32_t i = 0; i < constantCount && valid; i++) {
+        tags[i] = readU8(reader);
+        switch (tags[i]) {
+            case CONSTANT_NUMBER: readDouble(reader); break;
+            case CONSTANT_STRING: readBytes(reader, readU32(reader)); break;
+            case CONSTANT_FUNCTION:
+                children[i] = readU32(reader);
+                valid = children[i] < index;
+                break;
+            default: valid = false; break;
+        }
+        valid = valid && reader->valid;
+    }
+
+    uint32_t codeCount = readU32(reader);
+    const uint8_t* code = readBytes(reader, codeCount);
+    uint32_t lineCount = readU32(reader);
+    if (lineCount == 0 || lineCount > codeCount) reader->valid = false;
+    const uint8_t* lines = readBytes(reader, reader->valid ? (size_t) lineCount * sizeof(LineStart) : 0);
+    int32_t previous = -1;
+    for (uint32_t i = 0; i < lineCount && reader->valid; i++) {
+        // Runs start at offset 0 and strictly increase, so getLine() can binary search them
+        LineStart run;
+        memcpy(&run, lines + i * sizeof(LineStart), sizeof(LineStart));
+        reader->valid = (i == 0 ? run.offset == 0 : run.offset > previous) &&
+            (uint32_t) run.offset < codeCount;
+        previous = run.offset;
+    }
+    valid = valid && reader->valid &&
+        validateCode(code, codeCount, arity, tags, children, constantCount, upvalueCount, upvalueCounts);
+
+    upvalueCounts[index] = upvalueCount;
+    free(tags);
+    free(children);
+    return valid;
+}
+
+static bool validate(const uint8_t* bytes, size_t size, const char* source,
+                     uint32_t* functionCount, const uint8_t** functions) {
+    // Cache files are untrusted, so every index and jump is checked before any object is built
+    Reader reader = {.current = bytes, .end = bytes + size, .valid = true};
+    const uint8_t* magic = readBytes(&reader, 8);
+    if (magic == NULL || memcmp(magic, "CLOXBC\0\0", 8) != 0) return false;
+    if (readU32(&reader) != CACHE_FORMAT_VERSION) return false;
+    if (readU32(&reader) != CACHE_ENDIAN_CHECK) return false;
+
+    // The hash only names the file, two sources with the same hash must not share code
+    size_t sourceLength = strlen(source);
+    if (readU64(&reader) != hashSource(source, sourceLength)) return false;
+    if (readU64(&reader) != sourceLength) return false;
+    const uint8_t* cachedSource = readBytes(&reader, sourceLength);
+    if (cachedSource == NULL || memcmp(cachedSource, source, sourceLength) != 0) return false;
+
+    uint32_t count = readU32(&reader);
+    // Each function is held on the VM stack until the file is built, above whatever a running
+    // script already has there, and interning a string needs one more slot
+    size_t room = (size_t) (STACK_MAX - (vm.stackTop - vm.stack));
+    if (!reader.valid || count == 0 || count >= room) return false;
+    *functions = reader.current;
+    uint32_t* upvalueCounts = malloc(sizeof(uint32_t) * count);
+    if (upvalueCounts == NULL) exit(1);
+
+    bool valid = true;
+    for (uint32_t i = 0; i < count && valid; i++) {
+        valid = validateFunction(&reader, i, i == count - 1, upvalueCounts);
+    }
+    free(upvalueCounts);
+
+    *functionCount = count;
+    return valid && reader.valid && reader.current == reader.end;
+}
+
+static ObjFunction* buildFunction(Reader* reader, ObjFunction** functions) {
+    // Stays on the stack until every function has been built
+    ObjFunction* function = newFunction();
+    push(OBJ_VAL(function));
+    Chunk* chunk = &function->chunk;
+
+    function->arity = (int) readU32(reader);
+    function->upvalueCount = (int) readU32(reader);
+    uint32_t nameLength = readU32(reader);
+    if (nameLength != (uint32_t) -1) {
+        function->name = copyString((char*) readBytes(reader, nameLength), (int) nameLength);
+    }
+
+    uint32_t constantCount = readU32(reader);
+    chunk->constants.values = ALLOCATE(Value, constantCount);
+    chunk->constants.capacity = (int) constantCount;
+    for (uint32_t i = 0; i < constantCount; i++) {
+        Value value;
+        switch (readU8(reader)) {
+            case CONSTANT_NUMBER: value = NUMBER_VAL(readDouble(reader)); break;
+            case CONSTANT_STRING: {
+                uint32_t length = readU32(reader);
+                value = OBJ_VAL(copyString((char*) readBytes(reader, length), (int) length));
+                break;
+            }
+            default: value = OBJ_VAL(functions[readU32(reader)]); break;
+        }
+        chunk->constants.values[chunk->constants.count++] = value;
+    }
+
+    uint32_t codeCount = readU32(reader);
+    const uint8_t* code = readBytes(reader, codeCount);
+    chunk->code = ALLOCATE(uint8_t, codeCount);
+    memcpy(chunk->code, code, codeCount);
+    chunk->count = (int) codeCount;
+    chunk->capacity = (int) codeCount;
+
+    uint32_t lineCount = readU32(reader);
+    const uint8_t* lines = readBytes(reader, (size_t) lineCount * sizeof(LineStart));
+    chunk->lines = ALLOCATE(LineStart, lineCount);
+    memcpy(chunk->lines, lines, (size_t) lineCount * sizeof(LineStart));
+    chunk->lineCount = (int) lineCount;
+    chunk->lineCapacity = (int) lineCount;
+
+    return function;
+}
+
+ObjFunction* loadCachedFunction(const char* source) {
+    if (cacheDirectory == NULL) return NULL;
+
+    char path[4096];
+    cachePath(path, sizeof(path), hashSource(source, strlen(source)));
+    int descriptor = open(path, O_RDONLY);
+    if (descriptor == -1) return NULL;
+
+    struct stat status;
+    if (fstat(descriptor, &status) != 0 || status.st_size == 0) {
+        close(descriptor);
+        return NULL;
+    }
+    size_t size = (size_t) status.st_size;
+    const uint8_t* bytes = mmap(NULL, size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+    close(descriptor);
+    if (bytes == MAP_FAILED) return NULL;
+
+    ObjFunction* function = NULL;
+    uint32_t functionCount = 0;
+    const uint8_t* records = NULL;
+    if (validate(bytes, size, source, &functionCount, &records)) {
+        ObjFunction** functions = malloc(sizeof(ObjFunction*) * functionCount);
+        if (functions == NULL) exit(1);
+        Reader reader = {.current = records, .end = bytes + size, .valid = true};
+        for (uint32_t i = 0; i < functionCount; i++) {
+            functions[i] = buildFunction(&reader, functions);
+        }
+        function = functions[functionCount - 1];
+        vm.stackTop -= functionCount;
+        free(functions);
+    }
+
+    munmap((void*) bytes, size);
+    return function;
+}
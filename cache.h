@@ -0,0 +1,16 @@
+//
+// Created by Yuriy Kulinchenko on 18/10/2026.
+//
+
+#ifndef clox_cache_h
+#define clox_cache_h
+
+#include "common.h"
+#include "object.h"
+
+void setCacheDirectory(const char* path);
+
+ObjFunction* loadCachedFunction(const char* source);
+void storeCachedFunction(const char* source, ObjFunction* function);
+
+#endif
@@ -8,6 +8,8 @@ void initChunk(Chunk* chunk) {
     chunk->count = 0;
     chunk->capacity = 0;
     chunk->code = NULL;
+    chunk->lineCount = 0;
+    chunk->lineCapacity = 0;
     chunk->lines = NULL;
     initValueArray(&chunk->constants);
 }
@@ -17,24 +19,60 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line) {
         const int oldCapacity = chunk->capacity;
         chunk->capacity = oldCapacity < 8 ? 8 : oldCapacity * 2;
         chunk->code = GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
-        chunk->lines = GROW_ARRAY(int, chunk->lines, oldCapacity, chunk->capacity);
     }
     chunk->code[chunk->count] = byte;
-    chunk->lines[chunk->count] = line;
     chunk->count++;
+
+    // Only a change of line starts a new run
+    if (chunk->lineCount > 0 && chunk->lines[chunk->lineCount - 1].line == line) return;
+    if (chunk->lineCapacity < chunk->lineCount + 1) {
+        const int oldCapacity = chunk->lineCapacity;
+        chunk->lineCapacity = oldCapacity < 8 ? 8 : oldCapacity * 2;
+        chunk->lines = GROW_ARRAY(LineStart, chunk->lines, oldCapacity, chunk->lineCapacity);
+    }
+    LineStart* lineStart = &chunk->lines[chunk->lineCount++];
+    lineStart->offset = chunk->count - 1;
+    lineStart->line = line;
 }
 
 void freeChunk(Chunk* chunk) {
-    reallocate(chunk->code, chunk->capacity, 0);
-    reallocate(chunk->lines, chunk->capacity, 0);
+    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+    FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
     freeValueArray(&chunk->constants);
     initChunk(chunk);
 }
 
+void shrinkChunk(Chunk* chunk) {
+    // A finished chunk never grows again, so the doubling slack is given back
+    chunk->code = GROW_ARRAY(uint8_t, chunk->code, chunk->capacity, chunk->count);
+    chunk->capacity = chunk->count;
+    chunk->lines = GROW_ARRAY(LineStart, chunk->lines, chunk->lineCapacity, chunk->lineCount);
+    chunk->lineCapacity = chunk->lineCount;
+    shrinkValueArray(&chunk->constants);
+}
+
+int getLine(Chunk* chunk, int offset) {
+    // Binary search for the last run starting at or before offset
+    int low = 0;
+    int high = chunk->lineCount - 1;
+    while (low < high) {
+        int middle = (low + high + 1) / 2;
+        if (chunk->lines[middle].offset <= offset) {
+            low = middle;
+        } else {
+            high = middle - 1;
+        }
+    }
+    return chunk->lineCount == 0 ? 0 : chunk->lines[low].line;
+}
+
 int addConstant(Chunk* chunk, Value value) {
+    // Module compilers on other threads root their constants on the same stack
+    lockHeap();
     push(value);
     writeValueArray(&chunk->constants, value);
     pop();
+    unlockHeap();
     return chunk->constants.count - 1;
 }
 
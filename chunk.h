@@ -14,6 +14,8 @@ typedef enum {
     OP_FALSE,
     OP_NIL,
     OP_ADD,
+    OP_CONCAT_N, // Joins the top operand values into one string
+    OP_CHECK_ADDABLE, // Errors unless the value at the operand's distance from the top can be added
     OP_SUBTRACT,
     OP_MULTIPLY,
     OP_DIVIDE,
@@ -52,19 +54,31 @@ typedef enum {
     OP_INHERIT,
     OP_GET_SUPER,
     OP_SUPER_INVOKE,
+    OP_CONSTANT_LONG,
+    OP_WIDE, // Prefix, the next instruction has a 24 bit operand
+    OP_IMPORT,
 } OpCode;
 
+typedef struct {
+    int offset; // First byte compiled from this line
+    int line;
+} LineStart;
+
 typedef struct {
     int count;
     int capacity;
     uint8_t* code;
-    int* lines;
+    int lineCount;
+    int lineCapacity;
+    LineStart* lines; // One entry per run of bytes from the same line
     ValueArray constants;
 } Chunk;
 
 void initChunk(Chunk* chunk);
 void writeChunk(Chunk* chunk, uint8_t byte, int line);
 void freeChunk(Chunk* chunk);
+void shrinkChunk(Chunk* chunk);
+int getLine(Chunk* chunk, int offset);
 
 int addConstant(Chunk* chunk, Value value);
 
@@ -15,5 +15,8 @@
 // #define DEBUG_LOG_GC
 
 #define UINT8_COUNT (UINT8_MAX + 1)
+#define UINT16_COUNT (UINT16_MAX + 1)
+#define UINT24_MAX 0xffffff
+#define UINT24_COUNT (UINT24_MAX + 1)
 
 #endif
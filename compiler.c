@@ -2,6 +2,7 @@
 #include "common.h"
 #include "compiler.h"
 #include "scanner.h"
+#include "number.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
@@ -10,11 +11,17 @@
 #include <stdlib.h>
 #include <string.h>
 
+// Every element of a literal is on the VM stack before the array is made, so literals stay well
+// inside its STACK_MAX slots
+#define ARRAY_LITERAL_MAX (16 * UINT8_COUNT)
+
 typedef struct {
     Token current;
     Token previous;
     bool hadError;
     bool panicMode;
+    bool stringOperand; // The operand parsed last is a lone string literal
+    bool constantOperand; // The operand parsed last is a lone string or number literal
 } Parser;
 
 typedef void (*ParseFn)(bool canAssign);
@@ -46,6 +53,8 @@ typedef struct {
     int loopLocalCount; // Number of locals declared up to the outermost loop
     int loopContinue; // Address for conditional loop
     int loopBreak; // Address for unconditional loop
+    int depth; // Loops around the code being compiled, within this function
+    int id; // Identifies the outermost of them for the linter
 } LoopState;
 
 typedef struct {
@@ -63,28 +72,52 @@ typedef enum {
 } FunctionType;
 
 typedef struct {
-    uint8_t index;
+    int index;
     bool isLocal;
 } Upvalue;
 
+typedef struct {
+    Value value;
+    int index; // Slot in the chunk's constants, -1 marks an empty entry
+} ConstantEntry;
+
+typedef struct {
+    int count;
+    int capacity;
+    ConstantEntry* entries;
+} ConstantMap;
+
+typedef struct ArenaBlock {
+    struct ArenaBlock* next;
+    size_t size;
+    size_t used;
+    _Alignas(16) uint8_t bytes[];
+} ArenaBlock;
+
 typedef struct Compiler {
     struct Compiler* enclosing;
     ObjFunction* function;
     FunctionType type;
 
-    Local locals[UINT8_COUNT];
-    Upvalue upvalues[UINT8_COUNT];
+    Local* locals;
+    int localCapacity;
+    Upvalue* upvalues;
+    int upvalueCapacity;
     int localCount;
     int scopeDepth;
 
      // Custom
     int popCount; // Number of consecutive pop instructions
-    Table constants;
+    ConstantMap constants; // Deduplicates number and string constants
     LoopState loopState;
+    Token* lazyUpvalueNames; // Set when compiling a deferred body, which has no enclosing compiler
+    bool wideJumps; // Forward jumps get 24 bit offsets, set when retrying after a jump overflowed
+    bool jumpOverflow;
 } Compiler;
 
 typedef struct {
-    int lambdaCount;
+    _Atomic int lambdaCount; // Shared by every thread compiling a module
+    bool lazyFunctions; // Defer compiling function bodies until their first call
 } GlobalCompilerState;
 
 typedef struct ClassCompiler {
@@ -93,17 +126,94 @@ typedef struct ClassCompiler {
     bool hasSuperclass;
 } ClassCompiler;
 
+typedef struct {
+    Token name;
+    int line;
+    int loopId;
+    int depth;
+} LintName;
 
-GlobalCompilerState globalCompilerState = {.lambdaCount = 0};
-Parser parser;
-Compiler* current = NULL;
-ClassCompiler* currentClass = NULL;
+typedef struct {
+    LintName* names;
+    int count;
+    int capacity;
+} LintNames;
 
-void initCompiler(Compiler* compiler, FunctionType type) {
+typedef struct {
+    bool active;
+    uint8_t getOp; // The variable being assigned, as it would be read
+    int arg;
+    bool selfAppend; // The variable itself is an operand of a '+'
+    bool sawString;
+    bool sawNumber;
+} LintAssignment;
+
+typedef struct {
+    LintReport* report; // NULL unless compiling for --lint-perf
+    int loopCount;
+    // The last variable read and property read, by the offset just past them
+    Chunk* chunk;
+    int readEnd;
+    uint8_t readOp;
+    int readArg;
+    int propertyEnd;
+    Token property;
+    LintAssignment assignment;
+    LintNames globals; // Already reported for the loop they were found in
+    LintNames fields; // Every name assigned with '.name ='
+    LintNames methods;
+    LintNames invokes; // Calls like 'a.name()' inside loops
+} LintState;
+
+
+GlobalCompilerState globalCompilerState = {.lambdaCount = 0, .lazyFunctions = false};
+// Modules are compiled on worker threads, so each thread has its own parser and compilers
+_Thread_local Parser parser;
+_Thread_local Compiler* current = NULL;
+_Thread_local ClassCompiler* currentClass = NULL;
+_Thread_local ArenaBlock* compileArena = NULL; // Freed once a compile() or lazy body finishes
+_Thread_local LintState lint = {.report = NULL};
+_Thread_local bool silentErrors = false; // Prefetched imports report their errors only when they run
+
+static void* arenaAllocate(size_t size) {
+    size = (size + 15) & ~(size_t) 15;
+    if (compileArena == NULL || compileArena->size - compileArena->used < size) {
+        size_t blockSize = size > 64 * 1024 ? size : 64 * 1024;
+        ArenaBlock* block = malloc(sizeof(ArenaBlock) + blockSize);
+        if (block == NULL) exit(1);
+        block->next = compileArena;
+        block->size = blockSize;
+        block->used = 0;
+        compileArena = block;
+    }
+    void* result = compileArena->bytes + compileArena->used;
+    compileArena->used += size;
+    return result;
+}
+
+static void freeCompileArena() {
+    while (compileArena != NULL) {
+        ArenaBlock* next = compileArena->next;
+        free(compileArena);
+        compileArena = next;
+    }
+}
+
+static void initConstantMap(ConstantMap* map) {
+    map->count = 0;
+    map->capacity = 0;
+    map->entries = NULL;
+}
+
+static void initCompilerState(Compiler* compiler, FunctionType type) {
     compiler->enclosing = current;
     compiler->type = type;
     compiler->function = NULL;
 
+    compiler->locals = NULL;
+    compiler->localCapacity = 0;
+    compiler->upvalues = NULL;
+    compiler->upvalueCapacity = 0;
     compiler->localCount = 0;
     compiler->scopeDepth = 0;
 
@@ -111,8 +221,42 @@ void initCompiler(Compiler* compiler, FunctionType type) {
     compiler->popCount = 0;
     compiler->loopState = (LoopState)
     {.inLoop = false, .loopLocalCount = 0, .loopContinue = 0, .loopBreak = 0};
-    initTable(&compiler->constants);
+    initConstantMap(&compiler->constants);
+    compiler->lazyUpvalueNames = NULL;
+    compiler->wideJumps = false;
+    compiler->jumpOverflow = false;
+}
+
+static void freeCompilerState(Compiler* compiler) {
+    FREE_ARRAY(Local, compiler->locals, compiler->localCapacity);
+    FREE_ARRAY(Upvalue, compiler->upvalues, compiler->upvalueCapacity);
+}
+
+static Local* pushLocal() {
+    if (current->localCapacity < current->localCount + 1) {
+        int oldCapacity = current->localCapacity;
+        current->localCapacity = oldCapacity < 8 ? 8 : oldCapacity * 2;
+        current->locals = GROW_ARRAY(Local, current->locals, oldCapacity, current->localCapacity);
+    }
+    return &current->locals[current->localCount++];
+}
+
+static void addSlotZero() {
+    Local* local = pushLocal();
+    local->depth = 0;
+    local->isCaptured = false;
 
+    if (current->type == TYPE_METHOD || current->type == TYPE_INITIALIZER) {
+        local->name.start = "this";
+        local->name.length = 4;
+    } else {
+        local->name.start = "";
+        local->name.length = 0;
+    }
+}
+
+void initCompiler(Compiler* compiler, FunctionType type) {
+    initCompilerState(compiler, type);
     compiler->function = newFunction();
     current = compiler;
 
@@ -128,17 +272,18 @@ void initCompiler(Compiler* compiler, FunctionType type) {
         }
     }
 
-    Local* local = &current->locals[current->localCount++];
-    local->depth = 0;
-    local->isCaptured = false;
+    addSlotZero();
+}
 
-    if (type == TYPE_METHOD || type == TYPE_INITIALIZER) {
-        local->name.start = "this";
-        local->name.length = 4;
-    } else {
-        local->name.start = "";
-        local->name.length = 0;
-    }
+static void initLazyCompiler(Compiler* compiler, ObjFunction* function) {
+    // Reuses the stub created by the pre-scan, so its name, arity and upvalue count are kept
+    initCompilerState(compiler, (FunctionType) function->lazy->type);
+    compiler->enclosing = NULL;
+    compiler->function = function;
+    compiler->lazyUpvalueNames = function->lazy->upvalueNames;
+    current = compiler;
+
+    addSlotZero();
 }
 
 static void binary(bool canAssign);
@@ -173,8 +318,9 @@ static void patchJump(int offset);
 static int emitJump(uint8_t instruction);
 
 static void emitLoop(int loopStart);
+static bool retryWithWideJumps(Parser* start);
 
-static uint8_t identifierConstant(Token* name);
+static int identifierConstant(Token* name);
 static void namedVariable(Token name, bool canAssign);
 static Token syntheticToken(const char* name);
 
@@ -240,6 +386,8 @@ static Chunk* currentChunk() {
 static void errorAt(Token* token, const char* message) {
     if (parser.panicMode) return;
     parser.panicMode = true;
+    parser.hadError = true;
+    if (silentErrors) return;
     fprintf(stderr, "[line %d] Error", token->line);
 
     if (token->type == TOKEN_EOF) {
@@ -251,7 +399,6 @@ static void errorAt(Token* token, const char* message) {
     }
 
     fprintf(stderr, ": %s\n", message);
-    parser.hadError = true;
 }
 
 static void errorAtCurrent(char* message) {
@@ -275,6 +422,7 @@ static void synchronize() {
             case TOKEN_WHILE:
             case TOKEN_PRINT:
             case TOKEN_RETURN:
+            case TOKEN_IMPORT:
                 return;
             default:
                 // Do nothing.
@@ -322,8 +470,12 @@ static void flushPops() {
     if (current->popCount == 1) {
         emitOneByte(OP_POP);
     } else {
-        emitOneByte(OP_POP_COUNT);
-        emitOneByte(current->popCount);
+        while (current->popCount > 0) {
+            int count = current->popCount > UINT8_MAX ? UINT8_MAX : current->popCount;
+            emitOneByte(OP_POP_COUNT);
+            emitOneByte(count);
+            current->popCount -= count;
+        }
     }
     current->popCount = 0;
 }
@@ -347,9 +499,32 @@ static void emitBytes(uint8_t byte1, uint8_t byte2) {
     emitByte(byte2);
 }
 
+static void emitOperandByte(uint8_t byte) {
+    // Operands are never folded into pops, even when they equal OP_POP
+    flushPops();
+    emitOneByte(byte);
+}
+
+static void emitWide(int operand) {
+    emitOperandByte(operand >> 16 & 0xff);
+    emitOperandByte(operand >> 8 & 0xff);
+    emitOperandByte(operand & 0xff);
+}
+
+static void emitOperand(uint8_t instruction, int operand) {
+    // The one byte form stays the common case, larger operands take the OP_WIDE prefix
+    if (operand <= UINT8_MAX) {
+        emitByte(instruction);
+        emitOperandByte((uint8_t) operand);
+    } else {
+        emitBytes(OP_WIDE, instruction);
+        emitWide(operand);
+    }
+}
+
 static void emitReturn() {
     if (current->type == TYPE_INITIALIZER) {
-        emitBytes(OP_GET_LOCAL, 0);
+        emitOperand(OP_GET_LOCAL, 0);
     } else {
         emitByte(OP_NIL);
     }
@@ -357,11 +532,12 @@ static void emitReturn() {
 }
 
 static ObjFunction* endCompiler() {
-    emitReturn();
-    freeTable(&current->constants);
+    // The caller frees the compiler state once the upvalues have been emitted
     ObjFunction* function = current->function;
+    if (function->lazy == NULL) emitReturn();
+    shrinkChunk(currentChunk());
 #ifdef DEBUG_PRINT_CODE
-    if (!parser.hadError) {
+    if (!parser.hadError && function->lazy == NULL) {
         char* chars = function->name != NULL ? function->name->chars : "script";
         disassembleChunk(currentChunk(), chars);
     }
@@ -371,35 +547,87 @@ static ObjFunction* endCompiler() {
     return function;
 }
 
-static uint8_t makeConstant(Value value) {
-    Value returnValue;
-    ObjString* key = valueKey(value);
-    push(OBJ_VAL((Obj*)key));
-    if (key != NULL && tableGet(&current->constants, key, &returnValue)) {
-        pop();
-        return (uint8_t) AS_NUMBER(returnValue);
+static uint32_t hashConstant(Value value) {
+    if (IS_STRING(value)) return AS_STRING(value)->hash;
+
+    uint64_t bits;
+    double number = AS_NUMBER(value);
+    memcpy(&bits, &number, sizeof(bits));
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdULL;
+    bits ^= bits >> 33;
+    return (uint32_t) bits;
+}
+
+static bool sameConstant(Value a, Value b) {
+    // Compares bits rather than values, so 0 and -0 stay separate constants
+    if (IS_STRING(a) || IS_STRING(b)) return IS_OBJ(a) && IS_OBJ(b) && AS_OBJ(a) == AS_OBJ(b);
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+    return memcmp(&x, &y, sizeof(double)) == 0;
+}
+
+static ConstantEntry* findConstant(ConstantEntry* entries, int capacity, Value value) {
+    uint32_t index = hashConstant(value) & (capacity - 1);
+    for (;;) {
+        ConstantEntry* entry = &entries[index];
+        if (entry->index == -1 || sameConstant(entry->value, value)) return entry;
+        index = (index + 1) & (capacity - 1);
     }
+}
 
+static void growConstantMap(ConstantMap* map) {
+    // The old entries stay in the arena until compilation finishes
+    int capacity = map->capacity < 16 ? 16 : map->capacity * 2;
+    ConstantEntry* entries = arenaAllocate(sizeof(ConstantEntry) * capacity);
+    for (int i = 0; i < capacity; i++) {
+        entries[i].index = -1;
+    }
+    for (int i = 0; i < map->capacity; i++) {
+        ConstantEntry* entry = &map->entries[i];
+        if (entry->index != -1) *findConstant(entries, capacity, entry->value) = *entry;
+    }
+    map->entries = entries;
+    map->capacity = capacity;
+}
+
+static int makeConstant(Value value) {
+    // Strings are interned, so numbers and strings can be matched by their bits alone
+    ConstantEntry* entry = NULL;
+    if (IS_NUMBER(value) || IS_STRING(value)) {
+        ConstantMap* map = &current->constants;
+        if (map->count + 1 > map->capacity * 3 / 4) growConstantMap(map);
+        entry = findConstant(map->entries, map->capacity, value);
+        if (entry->index != -1) return entry->index;
+    }
 
     int constant = addConstant(currentChunk(), value);
-    if (constant > UINT8_MAX) {
+    if (constant > UINT24_MAX) {
         error("Too many constants in one chunk.");
         return 0;
     }
 
-    if (key != NULL) {
-        tableSet(&current->constants, key, NUMBER_VAL(constant));
+    if (entry != NULL) {
+        entry->value = value;
+        entry->index = constant;
+        current->constants.count++;
     }
-    pop();
-    return (uint8_t)constant;
+    return constant;
 }
 
-static void emitNumber(int n) {
-    emitBytes(OP_CONSTANT, makeConstant(NUMBER_VAL(n)));
+static void emitConstant(Value value) {
+    int constant = makeConstant(value);
+    if (constant <= UINT8_MAX) {
+        emitByte(OP_CONSTANT);
+        emitOperandByte((uint8_t) constant);
+    } else {
+        emitByte(OP_CONSTANT_LONG);
+        emitWide(constant);
+    }
 }
 
-static void emitConstant(Value value) {
-    emitBytes(OP_CONSTANT, makeConstant(value));
+static void emitNumber(int n) {
+    emitConstant(NUMBER_VAL(n));
 }
 
 static ParseRule* getRule(TokenType type) {
@@ -407,11 +635,13 @@ static ParseRule* getRule(TokenType type) {
 }
 
 static void number(bool canAssign) {
-    double value = strtod(parser.previous.start, NULL);
+    double value = parseNumber(parser.previous.start, parser.previous.length);
+    lint.assignment.sawNumber = true;
     emitConstant(NUMBER_VAL(value));
 }
 
 static void string(bool canAssign) {
+    lint.assignment.sawString = true;
     emitConstant(OBJ_VAL(copyString(parser.previous.start + 1, parser.previous.length - 2)));
 }
 
@@ -449,7 +679,10 @@ static void array(bool canAssign) {
         } while (match(TOKEN_COMMA));
     }
     consume(TOKEN_RIGHT_SQUARE, "Expect ']' at end of array");
-    emitBytes(OP_CREATE_ARRAY, (uint8_t) arraySize);
+    if (arraySize > ARRAY_LITERAL_MAX) {
+        error("Too many elements in array literal");
+    }
+    emitOperand(OP_CREATE_ARRAY, arraySize);
 }
 
 static void this_(bool canAssign) {
@@ -463,7 +696,7 @@ static void this_(bool canAssign) {
 static void super_(bool canAssign) {
     consume(TOKEN_DOT, "Expect '.' after super call");
     consume(TOKEN_IDENTIFIER, "Expect method name after super");
-    uint8_t methodName = identifierConstant(&parser.previous);
+    int methodName = identifierConstant(&parser.previous);
     namedVariable(syntheticToken("this"), false);
     if (match(TOKEN_LEFT_PAREN)) {
         uint8_t argumentCount = 0;
@@ -475,11 +708,11 @@ static void super_(bool canAssign) {
         }
         consume(TOKEN_RIGHT_PAREN, "Expect ')' after super call");
         namedVariable(syntheticToken("super"), false);
-        emitBytes(OP_SUPER_INVOKE, methodName);
-        emitByte(argumentCount);
+        emitOperand(OP_SUPER_INVOKE, methodName);
+        emitOperandByte(argumentCount);
     } else {
         namedVariable(syntheticToken("super"), false);
-        emitBytes(OP_GET_SUPER, methodName);
+        emitOperand(OP_GET_SUPER, methodName);
     }
 }
 
@@ -493,13 +726,21 @@ static void parsePrecedence(Precedence precedence) {
 
     bool canAssign = precedence <= PREC_ASSIGNMENT;
     prefixRule(canAssign);
+    bool stringOperand = prefixRule == string;
+    bool constantOperand = stringOperand || prefixRule == number;
 
     // repeatedly consume based on precedence
     while (precedence <= getRule(parser.current.type)->precedence) {
         // Note the '<=': explains the +1 in the binary() method
         advance();
+        parser.stringOperand = stringOperand; // The left operand, seen by binary()
+        parser.constantOperand = constantOperand;
         getRule(parser.previous.type)->infix(canAssign);
+        stringOperand = false;
+        constantOperand = false;
     }
+    parser.stringOperand = stringOperand;
+    parser.constantOperand = constantOperand;
 
     if (canAssign && match(TOKEN_EQUAL)) {
         error("Invalid assignment target");
@@ -510,20 +751,201 @@ static void expression() {
     parsePrecedence(PREC_ASSIGNMENT);
 }
 
+static bool lintingLoop() {
+    return lint.report != NULL && current->loopState.depth > 0;
+}
+
+static LintSeverity loopSeverity(LintSeverity severity) {
+    // Anything inside a nested loop runs another order of magnitude more often
+    if (current->loopState.depth > 1 && severity < SEVERITY_HIGH) severity++;
+    return severity;
+}
+
+static void addLintName(LintNames* names, Token* name) {
+    if (names->capacity < names->count + 1) {
+        int oldCapacity = names->capacity;
+        names->capacity = oldCapacity < 8 ? 8 : oldCapacity * 2;
+        names->names = GROW_ARRAY(LintName, names->names, oldCapacity, names->capacity);
+    }
+    names->names[names->count++] = (LintName) {
+        .name = *name, .line = parser.previous.line,
+        .loopId = current->loopState.id, .depth = current->loopState.depth
+    };
+}
+
+static bool hasLintName(LintNames* names, Token* name, int loopId) {
+    // A loopId of 0 matches the name in any loop
+    for (int i = 0; i < names->count; i++) {
+        LintName* entry = &names->names[i];
+        if (entry->name.length == name->length && memcmp(entry->name.start, name->start, name->length) == 0 &&
+            (loopId == 0 || entry->loopId == loopId)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void enterLoop() {
+    if (current->loopState.depth++ == 0) current->loopState.id = ++lint.loopCount;
+}
+
+static void lintGlobal(Token* name) {
+    if (!lintingLoop() || hasLintName(&lint.globals, name, current->loopState.id)) return;
+    addLintName(&lint.globals, name);
+    addLintFinding(lint.report, parser.previous.line, loopSeverity(SEVERITY_LOW),
+        "global '%.*s' is looked up by name on every iteration, copy it into a local before the loop",
+        name->length, name->start);
+}
+
+static void lintRead(uint8_t getOp, int arg) {
+    if (lint.report == NULL) return;
+    lint.chunk = currentChunk();
+    lint.readEnd = currentChunk()->count;
+    lint.readOp = getOp;
+    lint.readArg = arg;
+}
+
+static void lintConcatOperand() {
+    // Called on each side of a '+', an operand that was only the assigned variable ends
+    // exactly where the '+' is about to be emitted
+    LintAssignment* assignment = &lint.assignment;
+    if (!assignment->active || lint.chunk != currentChunk() || lint.readEnd != currentChunk()->count) return;
+    if (lint.readOp == assignment->getOp && lint.readArg == assignment->arg) assignment->selfAppend = true;
+}
+
+static LintAssignment beginLintAssignment(uint8_t getOp, int arg) {
+    LintAssignment enclosing = lint.assignment;
+    lint.assignment = (LintAssignment) {.active = lint.report != NULL, .getOp = getOp, .arg = arg};
+    return enclosing;
+}
+
+static void endLintAssignment(LintAssignment enclosing, Token* name) {
+    LintAssignment assignment = lint.assignment;
+    lint.assignment = enclosing;
+    if (!lintingLoop() || !assignment.selfAppend) return;
+
+    // Long strings grow as ropes, so appending is cheap until something needs the characters
+    if (assignment.sawString) {
+        addLintFinding(lint.report, parser.previous.line, loopSeverity(SEVERITY_MEDIUM),
+            "'%.*s' is built with '+' in a loop, printing or comparing it inside the loop copies "
+            "the whole string so far", name->length, name->start);
+    } else if (!assignment.sawNumber) {
+        // Most likely a running total, only slow when it holds a string
+        addLintFinding(lint.report, parser.previous.line, loopSeverity(SEVERITY_LOW),
+            "'%.*s = %.*s + ...' in a loop is quadratic if '%.*s' holds a string that is read "
+            "inside the loop", name->length, name->start, name->length, name->start,
+            name->length, name->start);
+    }
+}
+
+static void lintProperty(Token* name) {
+    if (lint.report == NULL) return;
+    lint.chunk = currentChunk();
+    lint.propertyEnd = currentChunk()->count;
+    lint.property = *name;
+}
+
+static void lintCall() {
+    if (!lintingLoop() || lint.chunk != currentChunk() || lint.propertyEnd != currentChunk()->count) return;
+    addLintFinding(lint.report, parser.previous.line, loopSeverity(SEVERITY_MEDIUM),
+        "'.%.*s' is read and then called, a method allocates a bound method on every call, "
+        "invoke it directly with '.%.*s(...)'",
+        lint.property.length, lint.property.start, lint.property.length, lint.property.start);
+}
+
+static void lintAppend() {
+    if (!lintingLoop()) return;
+    addLintFinding(lint.report, parser.previous.line, loopSeverity(SEVERITY_LOW),
+        "array grown one '<<' per iteration, it is reallocated and copied each time it fills up");
+}
+
+static void finishLint() {
+    // Whether a name is a method is only known once every class has been compiled
+    for (int i = 0; i < lint.invokes.count; i++) {
+        LintName* invoke = &lint.invokes.names[i];
+        if (!hasLintName(&lint.fields, &invoke->name, 0) || hasLintName(&lint.methods, &invoke->name, 0)) continue;
+        addLintFinding(lint.report, invoke->line, invoke->depth > 1 ? SEVERITY_MEDIUM : SEVERITY_LOW,
+            "'%.*s' is only ever assigned as a field, so every call searches the class's methods before the fields",
+            invoke->name.length, invoke->name.start);
+    }
+
+    FREE_ARRAY(LintName, lint.globals.names, lint.globals.capacity);
+    FREE_ARRAY(LintName, lint.fields.names, lint.fields.capacity);
+    FREE_ARRAY(LintName, lint.methods.names, lint.methods.capacity);
+    FREE_ARRAY(LintName, lint.invokes.names, lint.invokes.capacity);
+}
+
+void setPerfLint(LintReport* report) {
+    lint = (LintState) {.report = report, .chunk = NULL, .readEnd = -1, .propertyEnd = -1};
+}
+
+static void concatenation() {
+    // Takes a whole left associated '+' chain. From the first string literal on every '+' is
+    // a concatenation, so those operands are joined by one OP_CONCAT_N. The adds before it
+    // may still be numeric and stay as OP_ADD.
+    // OP_CONCAT_N only checks types once every operand is on the stack, so a joined operand
+    // that is not a literal is checked before the next one runs. A bad operand then stops the
+    // chain at the same point separate adds would
+    bool joining = parser.stringOperand;
+    bool leftChecked = parser.constantOperand; // Literals and the results of adds always add
+    int unchecked = -1; // Distance from the top of a joined operand still to be checked
+    int count = 1;
+    lintConcatOperand();
+    do {
+        if (unchecked >= 0) {
+            emitOperand(OP_CHECK_ADDABLE, unchecked);
+            unchecked = -1;
+        }
+        parsePrecedence(PREC_TERM + 1);
+        lintConcatOperand();
+        if (joining) {
+            count++;
+            if (!parser.constantOperand) unchecked = 0;
+        } else if (parser.stringOperand) {
+            joining = true;
+            count = 2;
+            if (!leftChecked) unchecked = 1;
+        } else {
+            emitByte(OP_ADD);
+            leftChecked = true;
+        }
+
+        if (count == UINT8_MAX) {
+            // The joined string becomes the first operand of the rest of the chain
+            emitOperand(OP_CONCAT_N, count);
+            count = 1;
+            unchecked = -1;
+        }
+    } while (match(TOKEN_PLUS));
+
+    // A single concatenation is already one allocation
+    if (count == 2) {
+        emitByte(OP_ADD);
+    } else if (count > 2) {
+        emitOperand(OP_CONCAT_N, count);
+    }
+}
+
 static void binary(bool canAssign) {
     TokenType operatorType = parser.previous.type;
+    if (operatorType == TOKEN_PLUS) {
+        concatenation();
+        return;
+    }
     ParseRule* rule = getRule(operatorType);
     parsePrecedence((Precedence)(rule->precedence + 1));
 
     switch (operatorType) {
-        case TOKEN_PLUS: emitByte(OP_ADD); break;
         case TOKEN_MINUS: emitByte(OP_SUBTRACT); break;
         case TOKEN_STAR: emitByte(OP_MULTIPLY); break;
         case TOKEN_SLASH: emitByte(OP_DIVIDE); break;
         case TOKEN_EQUAL_EQUAL: emitByte(OP_EQUAL); break;
         case TOKEN_LESS: emitByte(OP_LESS); break;
         case TOKEN_GREATER: emitByte(OP_GREATER); break;
-        case TOKEN_LESS_LESS: emitByte(OP_APPEND); break;
+        case TOKEN_LESS_LESS:
+            lintAppend();
+            emitByte(OP_APPEND);
+            break;
         case TOKEN_BANG_EQUAL: emitBytes(OP_EQUAL, OP_NOT); break;
         case TOKEN_LESS_EQUAL: emitBytes(OP_GREATER, OP_NOT); break;
         case TOKEN_GREATER_EQUAL: emitBytes(OP_LESS, OP_NOT); break;
@@ -567,6 +989,7 @@ static void or_(bool canAssign) {
 }
 
 static void call(bool canAssign) {
+    lintCall();
     int argumentCount = 0;
     if (!check(TOKEN_RIGHT_PAREN)) {
         do {
@@ -575,7 +998,8 @@ static void call(bool canAssign) {
         } while (match(TOKEN_COMMA));
     }
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after call");
-    emitBytes(OP_CALL, (uint8_t) argumentCount);
+    emitByte(OP_CALL);
+    emitOperandByte((uint8_t) argumentCount);
 }
 
 static void arrayAccess(bool canAssign) {
@@ -587,8 +1011,8 @@ static void arrayAccess(bool canAssign) {
         emitByte(OP_SET_ARRAY);
     } else if (canAssign && (match(TOKEN_PLUS_PLUS) || match(TOKEN_MINUS_MINUS))) {
         // Duplicate array and index, then access given element
-        emitBytes(OP_DUPLICATE, 1);
-        emitBytes(OP_DUPLICATE, 1);
+        emitOperand(OP_DUPLICATE, 1);
+        emitOperand(OP_DUPLICATE, 1);
         emitByte(OP_GET_ARRAY);
         // Add / subtract one, then set array
         emitNumber(1);
@@ -599,17 +1023,19 @@ static void arrayAccess(bool canAssign) {
     }
 }
 
-static uint8_t identifierConstant(Token* name) {
+static int identifierConstant(Token* name) {
     return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
 }
 
 static void dot(bool canAssign) {
     // '.' just consumed
     consume(TOKEN_IDENTIFIER, "Expect field name after '.'");
-    uint8_t fieldName = identifierConstant(&parser.previous);
+    Token field = parser.previous;
+    int fieldName = identifierConstant(&parser.previous);
     if (canAssign && match(TOKEN_EQUAL)) {
+        if (lint.report != NULL) addLintName(&lint.fields, &field);
         expression();
-        emitBytes(OP_SET_PROPERTY, fieldName);
+        emitOperand(OP_SET_PROPERTY, fieldName);
     } else {
         if (match(TOKEN_LEFT_PAREN)) {
             uint8_t argumentCount = 0;
@@ -620,21 +1046,23 @@ static void dot(bool canAssign) {
                 } while (match(TOKEN_COMMA));
             }
             consume(TOKEN_RIGHT_PAREN, "Expect ')' at end of function call");
-            emitBytes(OP_INVOKE, fieldName);
-            emitByte(argumentCount);
+            if (lintingLoop()) addLintName(&lint.invokes, &field);
+            emitOperand(OP_INVOKE, fieldName);
+            emitOperandByte(argumentCount);
         } else {
-            emitBytes(OP_GET_PROPERTY, fieldName);
+            emitOperand(OP_GET_PROPERTY, fieldName);
+            lintProperty(&field);
         }
     }
 }
 
 static void addLocal(Token name) {
-    if (current->localCount == UINT8_COUNT) {
+    if (current->localCount == UINT16_COUNT) {
         error("Too many local variables in function");
         return;
     }
 
-    Local* local = &current->locals[current->localCount++];
+    Local* local = pushLocal();
     local->name = name;
     local->depth = -1;
     local->isCaptured = false;
@@ -665,7 +1093,7 @@ static void declareVariable() {
     addLocal(*name);
 }
 
-static uint8_t parseVariable(const char* errorMessage) {
+static int parseVariable(const char* errorMessage) {
     consume(TOKEN_IDENTIFIER, errorMessage);
 
     declareVariable();
@@ -679,13 +1107,13 @@ static void markInitialized() {
     current->locals[current->localCount - 1].depth = current->scopeDepth;
 }
 
-static void defineVariable(uint8_t global) {
+static void defineVariable(int global) {
     if (current->scopeDepth > 0) {
         markInitialized();
         return; // Leave value on the stack
     }
 
-    emitBytes(OP_DEFINE_GLOBAL, global);
+    emitOperand(OP_DEFINE_GLOBAL, global);
 }
 
 int resolveLocal(Compiler* compiler, Token* token) {
@@ -701,13 +1129,24 @@ int resolveLocal(Compiler* compiler, Token* token) {
     return -1;
 }
 
-static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal) {
-    for (int i = 0; i < compiler->function->upvalueCount; i++) {
+static int addUpvalue(Compiler* compiler, int index, bool isLocal) {
+    int upvalueCount = compiler->function->upvalueCount;
+    for (int i = 0; i < upvalueCount; i++) {
         if (compiler->upvalues[i].index == index &&
             compiler->upvalues[i].isLocal == isLocal) {
             return i;
         }
     }
+
+    if (upvalueCount == UINT16_COUNT) {
+        error("Too many closure variables in function");
+        return 0;
+    }
+    if (compiler->upvalueCapacity < upvalueCount + 1) {
+        int oldCapacity = compiler->upvalueCapacity;
+        compiler->upvalueCapacity = oldCapacity < 8 ? 8 : oldCapacity * 2;
+        compiler->upvalues = GROW_ARRAY(Upvalue, compiler->upvalues, oldCapacity, compiler->upvalueCapacity);
+    }
     Upvalue* upvalue = &compiler->upvalues[compiler->function->upvalueCount++];
     upvalue->index = index;
     upvalue->isLocal = isLocal;
@@ -715,21 +1154,30 @@ static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal) {
 
 }
 
+static int resolveLazyUpvalue(Compiler* compiler, Token* token) {
+    // The enclosing compiler of a deferred body is gone, so upvalues are matched by the recorded names
+    if (compiler->lazyUpvalueNames == NULL) return -1;
+    for (int i = 0; i < compiler->function->upvalueCount; i++) {
+        if (identifiersEqual(token, &compiler->lazyUpvalueNames[i])) return i;
+    }
+    return -1;
+}
+
 int resolveUpvalue(Compiler* compiler, Token* token) {
     if (compiler->enclosing == NULL) {
-        return -1;
+        return resolveLazyUpvalue(compiler, token);
     }
     int index = resolveLocal(compiler->enclosing, token);
     // Check if upvalue is one scope out
     if (index != -1) {
         compiler->enclosing->locals[index].isCaptured = true;
-        return addUpvalue(compiler, (uint8_t)index, true);
+        return addUpvalue(compiler, index, true);
     }
 
     // Otherwise, recursively resolve compiler->enclosing
     index = resolveUpvalue(compiler->enclosing, token);
     if (index != -1) {
-        return addUpvalue(compiler, (uint8_t)index, false);
+        return addUpvalue(compiler, index, false);
     }
 
     return -1;
@@ -760,20 +1208,24 @@ static void namedVariable(Token name, bool canAssign) {
         arg = identifierConstant(&name);
         getOp = OP_GET_GLOBAL;
         setOp = OP_SET_GLOBAL;
+        lintGlobal(&name);
     }
 
     if (canAssign && match(TOKEN_EQUAL)) {
+        LintAssignment enclosing = beginLintAssignment(getOp, arg);
         expression();
-        emitBytes(setOp, (uint8_t)arg);
+        endLintAssignment(enclosing, &name);
+        emitOperand(setOp, arg);
     } else if (canAssign && (match(TOKEN_PLUS_PLUS) || match(TOKEN_MINUS_MINUS))) {
-        emitBytes(getOp, (uint8_t)arg);
-        emitBytes(OP_DUPLICATE, 0);
+        emitOperand(getOp, arg);
+        emitOperand(OP_DUPLICATE, 0);
         emitNumber(1);
         emitByte(parser.previous.type == TOKEN_PLUS_PLUS ? OP_ADD : OP_SUBTRACT);
-        emitBytes(setOp, (uint8_t)arg);
+        emitOperand(setOp, arg);
         emitByte(OP_POP);
     } else {
-        emitBytes(getOp, (uint8_t)arg);
+        emitOperand(getOp, arg);
+        lintRead(getOp, arg);
     }
 }
 
@@ -783,7 +1235,7 @@ static void variable(bool canAssign) {
 
 static void varDeclaration() {
     // 'var' has already been consumed
-    uint8_t global = parseVariable("Expect variable name"); // Unused if local
+    int global = parseVariable("Expect variable name"); // Unused if local
     if (match(TOKEN_EQUAL)) {
         expression();
     } else {
@@ -793,15 +1245,10 @@ static void varDeclaration() {
     defineVariable(global);
 }
 
-static void function(FunctionType type) {
-    Compiler compiler;
-    initCompiler(&compiler, type);
-    beginScope(); // Ensures variable declarations within functions are never global
-
-    // Compile parameters
+static void parameters(FunctionType type) {
     if (type == TYPE_ANONYMOUS && check(TOKEN_IDENTIFIER)) {
         current->function->arity = 1;
-        uint8_t param = parseVariable("Expect parameter name");
+        int param = parseVariable("Expect parameter name");
         defineVariable(param);
     } else {
         consume(TOKEN_LEFT_PAREN, "Expect '(' before parameters");
@@ -813,7 +1260,7 @@ static void function(FunctionType type) {
                     errorAtCurrent("Can't have more than 255 parameters.");
                 }
                 // All params are put onto the stack ?
-                uint8_t param = parseVariable("Expect parameter name");
+                int param = parseVariable("Expect parameter name");
                 defineVariable(param);
 
             } while (match(TOKEN_COMMA));
@@ -821,9 +1268,9 @@ static void function(FunctionType type) {
 
         consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters");
     }
+}
 
-
-    // Compile body
+static void functionBody(FunctionType type) {
     if (type == TYPE_ANONYMOUS && match(TOKEN_ARROW)) {
         expression();
         emitByte(OP_RETURN);
@@ -831,13 +1278,102 @@ static void function(FunctionType type) {
         consume(TOKEN_LEFT_BRACE, "Expect '{' before function body");
         block();
     }
+}
+
+static bool isUninitializedLocal(Token* name) {
+    // Reading such a local is an error, but the name may just be shadowed inside the skipped body
+    for (Compiler* compiler = current->enclosing; compiler != NULL; compiler = compiler->enclosing) {
+        for (int i = compiler->localCount - 1; i >= 0; i--) {
+            if (identifiersEqual(name, &compiler->locals[i].name)) {
+                return compiler->locals[i].depth == -1;
+            }
+        }
+    }
+    return false;
+}
+
+static void skipFunctionBody(Token* start, FunctionType type) {
+    // Only brace matching and upvalue discovery happen here, the bytecode is generated on the first call.
+    // Every name in the body that resolves outside the function is captured, shadowed ones included.
+    Token* names = NULL;
+    int nameCapacity = 0;
+    TokenType previousType = TOKEN_LEFT_BRACE;
+    int depth = 1;
+
+    consume(TOKEN_LEFT_BRACE, "Expect '{' before function body");
+    while (depth > 0 && !check(TOKEN_EOF)) {
+        advance();
+        Token* token = &parser.previous;
+        switch (token->type) {
+            case TOKEN_LEFT_BRACE: depth++; break;
+            case TOKEN_RIGHT_BRACE: depth--; break;
+            case TOKEN_IDENTIFIER:
+            case TOKEN_THIS:
+            case TOKEN_SUPER: {
+                if (previousType == TOKEN_DOT) break;
+                if (resolveLocal(current, token) != -1 || isUninitializedLocal(token)) break;
+                int index = resolveUpvalue(current, token);
+                if (index == -1) break;
+                if (nameCapacity < index + 1) {
+                    int oldCapacity = nameCapacity;
+                    nameCapacity = oldCapacity < 8 ? 8 : oldCapacity * 2;
+                    names = GROW_ARRAY(Token, names, oldCapacity, nameCapacity);
+                }
+                names[index] = *token;
+                break;
+            }
+            default: break;
+        }
+        previousType = token->type;
+    }
+    if (depth > 0) errorAtCurrent("Expect '}' at end of block");
+
+    ObjFunction* function = current->function;
+    LazyBody* lazy = ALLOCATE(LazyBody, 1);
+    lazy->source = start->start;
+    lazy->line = start->line;
+    lazy->type = (uint8_t) type;
+    lazy->inClass = currentClass != NULL;
+    lazy->upvalueNames = NULL;
+    function->lazy = lazy;
+    lazy->upvalueNames = ALLOCATE(Token, function->upvalueCount);
+    if (function->upvalueCount > 0) {
+        memcpy(lazy->upvalueNames, names, sizeof(Token) * function->upvalueCount);
+    }
+    FREE_ARRAY(Token, names, nameCapacity);
+}
+
+static void function(FunctionType type) {
+    Compiler compiler;
+    initCompiler(&compiler, type);
+    Parser start = parser;
+
+    do {
+        beginScope(); // Ensures variable declarations within functions are never global
+        parameters(type);
+
+        if (globalCompilerState.lazyFunctions && check(TOKEN_LEFT_BRACE)) {
+            skipFunctionBody(&start.current, type);
+        } else {
+            functionBody(type);
+        }
+    } while (retryWithWideJumps(&start));
 
     ObjFunction* function = endCompiler();
-    emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
+    emitOperand(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
     for (int i = 0; i < function->upvalueCount; i++) {
-        emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
-        emitByte(compiler.upvalues[i].index);
+        // Bit 0 marks a local of the enclosing function, bit 1 a 24 bit index
+        Upvalue* upvalue = &compiler.upvalues[i];
+        uint8_t flags = upvalue->isLocal ? 1 : 0;
+        if (upvalue->index > UINT8_MAX) {
+            emitOperandByte(flags | 2);
+            emitWide(upvalue->index);
+        } else {
+            emitOperandByte(flags);
+            emitOperandByte((uint8_t) upvalue->index);
+        }
     }
+    freeCompilerState(&compiler);
 }
 
 static void anonymousFunction(bool canAssign) {
@@ -845,11 +1381,21 @@ static void anonymousFunction(bool canAssign) {
 }
 
 static void funDeclaration() {
-    uint8_t global = parseVariable("Expect function name");
+    int global = parseVariable("Expect function name");
     function(TYPE_FUNCTION);
     defineVariable(global);
 }
 
+static void importStatement() {
+    // import "path"; copies the module's globals into this one's when it runs. The copy is a
+    // snapshot: later assignments on either side are not seen by the other, a value that is an
+    // object (an instance, an array) is still shared
+    consume(TOKEN_STRING, "Expect module path after 'import'");
+    ObjString* path = copyString(parser.previous.start + 1, parser.previous.length - 2);
+    emitOperand(OP_IMPORT, makeConstant(OBJ_VAL(path)));
+    consume(TOKEN_SEMICOLON, "Expect ';' after import");
+}
+
 static void printStatement() {
     expression();
     emitByte(OP_PRINT);
@@ -905,7 +1451,8 @@ static void block() {
 
 static void method() {
     consume(TOKEN_IDENTIFIER, "Expect method name");
-    uint8_t methodName = identifierConstant(&parser.previous);
+    if (lint.report != NULL) addLintName(&lint.methods, &parser.previous);
+    int methodName = identifierConstant(&parser.previous);
     FunctionType type;
     if (parser.previous.length == 4 && memcmp(parser.previous.start, "init", 4) == 0) {
         type = TYPE_INITIALIZER;
@@ -914,7 +1461,7 @@ static void method() {
     }
 
     function(type); // emits OP_CLOSURE
-    emitBytes(OP_METHOD, methodName);
+    emitOperand(OP_METHOD, methodName);
 }
 
 static Token syntheticToken(const char* name) {
@@ -930,11 +1477,11 @@ static Token syntheticToken(const char* name) {
 static void classDeclaration() {
     consume(TOKEN_IDENTIFIER, "Expect class name");
     Token className = parser.previous;
-    uint8_t nameConstant = identifierConstant(&parser.previous);
+    int nameConstant = identifierConstant(&parser.previous);
 
 
     declareVariable();
-    emitBytes(OP_CLASS, nameConstant);
+    emitOperand(OP_CLASS, nameConstant);
     defineVariable(nameConstant);
     ClassCompiler classCompiler = {.enclosing = currentClass, .name = parser.previous};
     currentClass = &classCompiler;
@@ -988,26 +1535,80 @@ static void declaration() {
 
 static void patchJump(int offset) {
     flushPops();
+    uint8_t* code = currentChunk()->code;
+    if (current->wideJumps) {
+        int jump = currentChunk()->count - offset - 3;
+        if (jump > UINT24_MAX) {
+            error("Too much code to jump over");
+        }
+        code[offset] = jump >> 16 & 0xff;
+        code[offset + 1] = jump >> 8 & 0xff;
+        code[offset + 2] = jump & 0xff;
+        return;
+    }
+
     int jump = currentChunk()->count - offset - 2;
     if (jump > UINT16_MAX) {
-        error("Too much code to jump over");
+        // The function is compiled again with wide jumps once it has been parsed
+        current->jumpOverflow = true;
+        return;
     }
-    currentChunk()->code[offset] = jump >> 8 & 0xff;
-    currentChunk()->code[offset + 1] = jump & 0xff;
+    code[offset] = jump >> 8 & 0xff;
+    code[offset + 1] = jump & 0xff;
 }
 
 static int emitJump(uint8_t instruction) {
+    if (current->wideJumps) {
+        emitBytes(OP_WIDE, instruction);
+        emitWide(UINT24_MAX);
+        return currentChunk()->count - 3;
+    }
     emitByte(instruction);
-    emitBytes(0xff, 0xff);
+    emitOperandByte(0xff);
+    emitOperandByte(0xff);
     return currentChunk()->count - 2;
 }
 
 static void emitLoop(int loopStart) {
-    emitByte(OP_LOOP);
-    int offset = currentChunk()->count - loopStart + 2;
-    if (offset > UINT16_MAX) error("Loop body too large.");
-    emitByte(offset >> 8 & 0xff);
-    emitByte(offset & 0xff);
+    flushPops();
+    int offset = currentChunk()->count - loopStart + 3;
+    if (offset <= UINT16_MAX) {
+        emitByte(OP_LOOP);
+        emitOperandByte(offset >> 8 & 0xff);
+        emitOperandByte(offset & 0xff);
+        return;
+    }
+
+    // OP_WIDE and the longer operand add two more bytes to jump back over
+    offset += 2;
+    if (offset > UINT24_MAX) error("Loop body too large.");
+    emitBytes(OP_WIDE, OP_LOOP);
+    emitWide(offset);
+}
+
+static bool retryWithWideJumps(Parser* start) {
+    // A jump overflowed 16 bits, so the function is parsed again from the same token
+    if (!current->jumpOverflow || parser.hadError) return false;
+
+    parser = *start;
+    initScannerAt(parser.current.start + parser.current.length, parser.current.line);
+
+    ObjFunction* function = current->function;
+    freeChunk(&function->chunk);
+    function->arity = 0;
+    if (current->lazyUpvalueNames == NULL) function->upvalueCount = 0;
+
+    current->localCount = 0;
+    current->scopeDepth = 0;
+    current->popCount = 0;
+    current->loopState = (LoopState)
+    {.inLoop = false, .loopLocalCount = 0, .loopContinue = 0, .loopBreak = 0};
+    initConstantMap(&current->constants);
+    current->jumpOverflow = false;
+    current->wideJumps = true;
+
+    addSlotZero();
+    return true;
 }
 
 static void ifStatement() {
@@ -1032,6 +1633,7 @@ static void whileStatement() {
     LoopState oldLoopState = current->loopState;
     current->loopState.loopLocalCount = current->localCount;
     current->loopState.inLoop = true;
+    enterLoop();
 
     int startJump = emitJump(OP_JUMP);
     current->loopState.loopBreak = currentChunk()->count;
@@ -1074,6 +1676,7 @@ static void forStatement() {
     } else {
         consume(TOKEN_SEMICOLON, "Expect ';' after loop initializer.");
     }
+    enterLoop();
 
     int loopStart = currentChunk()->count;
 
@@ -1140,6 +1743,8 @@ static void breakStatement() {
 static void statement() {
     if (match(TOKEN_PRINT)) {
         printStatement();
+    } else if (match(TOKEN_IMPORT)) {
+        importStatement();
     } else if (match(TOKEN_LEFT_BRACE)) {
         block();
     } else if (match(TOKEN_IF)) {
@@ -1170,20 +1775,63 @@ ObjFunction* compile(const char* source) {
     parser.panicMode = false;
 
     advance();
+    Parser start = parser;
 
-    while (!match(TOKEN_EOF)) {
-        declaration();
-    }
-
+    do {
+        while (!match(TOKEN_EOF)) {
+            declaration();
+        }
+    } while (retryWithWideJumps(&start));
 
     ObjFunction* function = endCompiler();
+    freeCompilerState(&compiler);
+    freeCompileArena();
+    if (lint.report != NULL) finishLint();
     return parser.hadError ? NULL : function;
 }
 
+bool compileLazyFunction(ObjFunction* function) {
+    // Runs on the first call of a function whose body was only pre-scanned
+    LazyBody* lazy = function->lazy;
+    initScannerAt(lazy->source, lazy->line);
+    Compiler compiler;
+    initLazyCompiler(&compiler, function);
+    function->arity = 0;
+
+    ClassCompiler classCompiler = {.enclosing = NULL, .hasSuperclass = false};
+    currentClass = lazy->inClass ? &classCompiler : NULL;
+
+    parser.hadError = false;
+    parser.panicMode = false;
+
+    advance();
+    Parser start = parser;
+    do {
+        beginScope();
+        parameters(compiler.type);
+        functionBody(compiler.type);
+    } while (retryWithWideJumps(&start));
+
+    // Compiled for real now, so the body is no longer deferred
+    freeLazyBody(function);
+    endCompiler();
+    freeCompilerState(&compiler);
+    freeCompileArena();
+    currentClass = NULL;
+    return !parser.hadError;
+}
+
+void setLazyCompilation(bool enabled) {
+    globalCompilerState.lazyFunctions = enabled;
+}
+
+void setSilentErrors(bool silent) {
+    silentErrors = silent;
+}
+
 void markCompilerRoots() {
     // Traverse list of compilers
     for (Compiler* compiler = current; compiler != NULL; compiler = compiler->enclosing) {
         markObject((Obj*) compiler->function);
-        markTable(&compiler->constants);
     }
 }
\ No newline at end of file
@@ -7,9 +7,14 @@
 
 #include "vm.h"
 #include "object.h"
+#include "lint.h"
 
 
 ObjFunction* compile(const char* source);
+bool compileLazyFunction(ObjFunction* function);
+void setLazyCompilation(bool enabled);
+void setSilentErrors(bool silent);
+void setPerfLint(LintReport* report);
 void markCompilerRoots();
 
 #endif
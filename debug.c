@@ -16,52 +16,88 @@ static int simpleInstruction(const char* name, int offset) {
     return offset + 1;
 }
 
-static int constantInstruction(const char* name, Chunk* chunk, int offset) {
-    uint8_t constant = chunk->code[offset + 1];
+static int readOperand(Chunk* chunk, int offset, int width) {
+    // Operands are one byte, or three bytes big endian after OP_WIDE
+    if (width == 1) return chunk->code[offset];
+    return chunk->code[offset] << 16 | chunk->code[offset + 1] << 8 | chunk->code[offset + 2];
+}
+
+static int constantInstruction(const char* name, Chunk* chunk, int offset, int width) {
+    int constant = readOperand(chunk, offset + 1, width);
     printf("%-16s %4d ", name, constant);
     printValue(chunk->constants.values[constant]);
     printf("\n");
-    return offset + 2;
+    return offset + 1 + width;
 }
 
-static int invokeInstruction(const char* name, Chunk* chunk, int offset) {
-    uint8_t constant = chunk->code[offset + 1];
-    uint8_t argCount = chunk->code[offset + 2];
+static int invokeInstruction(const char* name, Chunk* chunk, int offset, int width) {
+    int constant = readOperand(chunk, offset + 1, width);
+    uint8_t argCount = chunk->code[offset + 1 + width];
 
     printf("%-16s %4d ", name, constant);
     printValue(chunk->constants.values[constant]);
     printf("  (%d args)", argCount);
     printf("\n");
 
-    return offset + 3;
+    return offset + 2 + width;
 }
 
-static int byteInstruction(const char* name, Chunk* chunk, int offset) {
-    uint8_t slot = chunk->code[offset + 1];
+static int byteInstruction(const char* name, Chunk* chunk, int offset, int width) {
+    int slot = readOperand(chunk, offset + 1, width);
     printf("%-16s %4d\n", name, slot);
-    return offset + 2;
+    return offset + 1 + width;
 }
 
 static int jumpInstruction(const char* name, int sign,
-Chunk* chunk, int offset) {
-    uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
-    jump |= chunk->code[offset + 2];
+Chunk* chunk, int offset, int width) {
+    int jump = width == 1 ? chunk->code[offset + 1] << 8 | chunk->code[offset + 2]
+                          : readOperand(chunk, offset + 1, width);
+    int next = offset + 1 + (width == 1 ? 2 : width);
     printf("%-16s %4d -> %d\n"
     , name, offset,
-    offset + 3 + sign * jump);
-    return offset + 3;
+    next + sign * jump);
+    return next;
+}
+
+static int closureInstruction(Chunk* chunk, int offset, int width) {
+    offset++;
+    int constant = readOperand(chunk, offset, width);
+    offset += width;
+    printf("%-16s %4d ", "OP_CLOSURE", constant);
+    printValue(chunk->constants.values[constant]);
+    printf("\n");
+
+    ObjFunction* function = AS_FUNCTION(chunk->constants.values[constant]);
+    for (int j = 0; j < function->upvalueCount; j++) {
+        // Bit 0 marks a local, bit 1 a 24 bit index
+        int start = offset;
+        int flags = chunk->code[offset++];
+        int index = readOperand(chunk, offset, flags & 2 ? 3 : 1);
+        offset += flags & 2 ? 3 : 1;
+        printf("%04d    | %28s %d\n",
+       start,
+       flags & 1 ? "local" : "upvalue",
+       index);
+    }
+
+    return offset;
 }
 
+static int operation(Chunk* chunk, int offset, int width);
 
 int disassembleInstruction(Chunk* chunk, int offset) {
     printf("%04d ", offset);
-    if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
+    int line = getLine(chunk, offset);
+    if (offset > 0 && line == getLine(chunk, offset - 1)) {
         printf("   | ");
     } else {
-        printf("%4d ", chunk->lines[offset]);
+        printf("%4d ", line);
     }
 
+    return operation(chunk, offset, 1);
+}
 
+static int operation(Chunk* chunk, int offset, int width) {
     uint8_t instruction = chunk->code[offset];
     switch (instruction) {
         case OP_RETURN:
@@ -105,70 +141,66 @@ int disassembleInstruction(Chunk* chunk, int offset) {
         case OP_INHERIT:
             return simpleInstruction("OP_INHERIT", offset);
         case OP_CONSTANT:
-            return constantInstruction("OP_CONSTANT", chunk, offset);
+            return constantInstruction("OP_CONSTANT", chunk, offset, width);
         case OP_DEFINE_GLOBAL:
-            return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+            return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset, width);
         case OP_GET_GLOBAL:
-            return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+            return constantInstruction("OP_GET_GLOBAL", chunk, offset, width);
         case OP_SET_GLOBAL:
-            return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+            return constantInstruction("OP_SET_GLOBAL", chunk, offset, width);
         case OP_SET_PROPERTY:
-            return constantInstruction("OP_SET_PROPERTY", chunk, offset);
+            return constantInstruction("OP_SET_PROPERTY", chunk, offset, width);
         case OP_GET_PROPERTY:
-            return constantInstruction("OP_GET_PROPERTY", chunk, offset);
+            return constantInstruction("OP_GET_PROPERTY", chunk, offset, width);
         case OP_METHOD:
-            return constantInstruction("OP_METHOD", chunk, offset);
+            return constantInstruction("OP_METHOD", chunk, offset, width);
         case OP_CLASS:
-            return constantInstruction("OP_CLASS", chunk, offset);
+            return constantInstruction("OP_CLASS", chunk, offset, width);
         case OP_GET_SUPER:
-            return constantInstruction("OP_GET_SUPER", chunk, offset);
+            return constantInstruction("OP_GET_SUPER", chunk, offset, width);
+        case OP_IMPORT:
+            return constantInstruction("OP_IMPORT", chunk, offset, width);
         case OP_GET_LOCAL:
-            return byteInstruction("OP_GET_LOCAL", chunk, offset);
+            return byteInstruction("OP_GET_LOCAL", chunk, offset, width);
         case OP_SET_LOCAL:
-            return byteInstruction("OP_SET_LOCAL", chunk, offset);
+            return byteInstruction("OP_SET_LOCAL", chunk, offset, width);
         case OP_POP_COUNT:
-            return byteInstruction("OP_POP_COUNT", chunk, offset);
+            return byteInstruction("OP_POP_COUNT", chunk, offset, width);
         case OP_CALL:
-            return byteInstruction("OP_CALL", chunk, offset);
+            return byteInstruction("OP_CALL", chunk, offset, width);
+        case OP_CONCAT_N:
+            return byteInstruction("OP_CONCAT_N", chunk, offset, width);
+        case OP_CHECK_ADDABLE:
+            return byteInstruction("OP_CHECK_ADDABLE", chunk, offset, width);
         case OP_CREATE_ARRAY:
-            return byteInstruction("OP_ARRAY_CREATE", chunk, offset);
+            return byteInstruction("OP_ARRAY_CREATE", chunk, offset, width);
         case OP_DUPLICATE:
-            return byteInstruction("OP_DUPLICATE", chunk, offset);
+            return byteInstruction("OP_DUPLICATE", chunk, offset, width);
         case OP_GET_UPVALUE:
-            return byteInstruction("OP_GET_UPVALUE", chunk, offset);
+            return byteInstruction("OP_GET_UPVALUE", chunk, offset, width);
         case OP_SET_UPVALUE:
-            return byteInstruction("OP_SET_UPVALUE", chunk, offset);
+            return byteInstruction("OP_SET_UPVALUE", chunk, offset, width);
         case OP_JUMP_IF_FALSE:
-            return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
+            return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset, width);
         case OP_JUMP:
-            return jumpInstruction("OP_JUMP", 1, chunk, offset);
+            return jumpInstruction("OP_JUMP", 1, chunk, offset, width);
         case OP_LOOP:
-            return jumpInstruction("OP_LOOP", -1, chunk, offset);
+            return jumpInstruction("OP_LOOP", -1, chunk, offset, width);
         case OP_INVOKE:
-            return invokeInstruction("OP_INVOKE", chunk, offset);
+            return invokeInstruction("OP_INVOKE", chunk, offset, width);
         case OP_SUPER_INVOKE:
-            return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
-        case OP_CLOSURE: {
-            offset++;
-            uint8_t constant = chunk->code[offset++];
-            printf("%-16s %4d ", "OP_CLOSURE", constant);
-            printValue(chunk->constants.values[constant]);
-            printf("\n");
-
-            ObjFunction* function = AS_FUNCTION(chunk->constants.values[constant]);
-            for (int j = 0; j < function->upvalueCount; j++) {
-                int isLocal = chunk->code[offset++];
-                int index = chunk->code[offset++];
-                printf("%04d    | %28s %d\n",
-       offset - 2,
-       isLocal ? "local" : "upvalue",
-       index);
-            }
-
-            return offset;
-        }
+            return invokeInstruction("OP_SUPER_INVOKE", chunk, offset, width);
+        case OP_CLOSURE:
+            return closureInstruction(chunk, offset, width);
+        case OP_CONSTANT_LONG:
+            return constantInstruction("OP_CONSTANT_LONG", chunk, offset, 3);
+        case OP_WIDE:
+            if (width != 1) break;
+            printf("OP_WIDE ");
+            return operation(chunk, offset + 1, 3);
         default:
-            printf("Unknown opcode %d\n", instruction);
-            return offset + 1;
+            break;
     }
+    printf("Unknown opcode %d\n", instruction);
+    return offset + 1;
 }
\ No newline at end of file
@@ -0,0 +1,288 @@
+#include <ctype.h>
+#include <dlfcn.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "foreign.h"
+#include "vm.h"
+
+// Calls go through a pointer cast to take every integer register and every floating point
+// register. Integer and floating point arguments are assigned registers separately, in order,
+// so this matches any C function with up to FOREIGN_MAX_INTEGERS integer or pointer arguments
+// and FOREIGN_MAX_DOUBLES double arguments, however they are interleaved. Unused registers
+// hold zeroes the callee never reads. Variadic functions are not supported
+#if defined(__x86_64__) || defined(__aarch64__)
+#define FOREIGN_SUPPORTED
+typedef int64_t (*IntegerCall)(int64_t, int64_t, int64_t, int64_t, int64_t, int64_t,
+    double, double, double, double, double, double, double, double);
+typedef double (*DoubleCall)(int64_t, int64_t, int64_t, int64_t, int64_t, int64_t,
+    double, double, double, double, double, double, double, double);
+#endif
+
+typedef struct {
+    const char* name;
+    ForeignType type;
+} ForeignTypeName;
+
+static const ForeignTypeName typeNames[] = {
+    {"void", FOREIGN_VOID},
+    {"double", FOREIGN_DOUBLE},
+    {"int32", FOREIGN_INT32},
+    {"int64", FOREIGN_INT64},
+    {"pointer", FOREIGN_POINTER},
+    {"string", FOREIGN_STRING},
+};
+
+static const char* skipSpaces(const char* cursor) {
+    while (*cursor == ' ') cursor++;
+    return cursor;
+}
+
+static bool parseType(const char** cursor, ForeignType* type) {
+    const char* start = skipSpaces(*cursor);
+    const char* end = start;
+    while (isalnum((unsigned char) *end)) end++;
+    for (int i = 0; i < (int) (sizeof(typeNames) / sizeof(typeNames[0])); i++) {
+        if ((size_t) (end - start) == strlen(typeNames[i].name) &&
+            memcmp(start, typeNames[i].name, end - start) == 0) {
+            *type = typeNames[i].type;
+            *cursor = skipSpaces(end);
+            return true;
+        }
+    }
+    return false;
+}
+
+static const char* parseSignature(const char* signature, ObjForeign* foreign) {
+    // "return(argument, ...)", returns an error message or NULL
+    const char* cursor = signature;
+    ForeignType type;
+    if (!parseType(&cursor, &type)) return "Expect a return type";
+    foreign->returnType = type;
+    if (*cursor++ != '(') return "Expect '(' after the return type";
+
+    int integers = 0;
+    int doubles = 0;
+    foreign->arity = 0;
+    cursor = skipSpaces(cursor);
+    if (*cursor != ')') {
+        do {
+            if (!parseType(&cursor, &type) || type == FOREIGN_VOID) return "Expect an argument type";
+            if (type == FOREIGN_DOUBLE) {
+                if (++doubles > FOREIGN_MAX_DOUBLES) return "Too many double arguments";
+            } else if (++integers > FOREIGN_MAX_INTEGERS) {
+                return "Too many integer, pointer and string arguments";
+            }
+            foreign->argumentTypes[foreign->arity++] = type;
+        } while (*cursor++ == ',');
+        cursor--;
+    }
+    if (*cursor++ != ')') return "Expect ')' after the argument types";
+    if (*skipSpaces(cursor) != '\0') return "Unexpected characters after the signature";
+    return NULL;
+}
+
+static char* copyCString(ObjString* string) {
+    // Slices are not NUL terminated, so C always gets its own copy
+    char* chars = malloc(string->length + 1);
+    if (chars == NULL) exit(1);
+    memcpy(chars, stringChars(string), string->length);
+    chars[string->length] = '\0';
+    return chars;
+}
+
+static bool foreignNative(int argumentCount, Value* arguments, Value* result) {
+    // foreign(library, symbol, signature). The same three arguments give back the same
+    // function, so binding in a loop does not repeat the lookup or the parsing
+    for (int i = 0; i < 3; i++) {
+        if (!IS_STRING(arguments[i])) {
+            runtimeError("Arguments of foreign must be strings");
+            return false;
+        }
+    }
+#ifndef FOREIGN_SUPPORTED
+    runtimeError("Foreign calls are not supported on this platform");
+    return false;
+#else
+    Writer key;
+    initWriter(&key, NULL, 0, NULL);
+    for (int i = 0; i < 3; i++) {
+        if (i > 0) writeChars(&key, "\n", 1);
+        ObjString* part = AS_STRING(arguments[i]);
+        writeChars(&key, stringChars(part), part->length);
+    }
+    ObjString* keyString = copyString(key.chars, key.length);
+    free(key.chars);
+    push(OBJ_VAL(keyString));
+    if (tableGet(&vm.foreignFunctions, keyString, result)) {
+        pop();
+        return true;
+    }
+
+    ObjForeign parsed;
+    char* signature = copyCString(AS_STRING(arguments[2]));
+    const char* error = parseSignature(signature, &parsed);
+    free(signature);
+    if (error != NULL) {
+        runtimeError("Invalid signature for foreign: %s", error);
+        return false;
+    }
+
+    char* library = copyCString(AS_STRING(arguments[0]));
+    void* handle = dlopen(library, RTLD_NOW);
+    if (handle == NULL) {
+        runtimeError("Could not load library '%s': %s", library, dlerror());
+        free(library);
+        return false;
+    }
+    free(library);
+    // The library stays loaded for the rest of the run, its functions may still be called
+    char* symbolName = copyCString(AS_STRING(arguments[1]));
+    void* symbol = dlsym(handle, symbolName);
+    free(symbolName);
+    if (symbol == NULL) {
+        runtimeError("Could not find symbol: %s", dlerror());
+        return false;
+    }
+
+    push(OBJ_VAL(internString(AS_STRING(arguments[1]))));
+    ObjForeign* foreign = newForeign(AS_STRING(vm.stackTop[-1]), symbol);
+    foreign->returnType = parsed.returnType;
+    foreign->arity = parsed.arity;
+    memcpy(foreign->argumentTypes, parsed.argumentTypes, parsed.arity);
+    push(OBJ_VAL(foreign));
+    tableSet(&vm.foreignFunctions, keyString, OBJ_VAL(foreign));
+    vm.stackTop -= 3;
+    *result = OBJ_VAL(foreign);
+    return true;
+#endif
+}
+
+void initForeign() {
+    defineNative("foreign", foreignNative, 3);
+}
+
+#ifdef FOREIGN_SUPPORTED
+static bool marshal(ObjForeign* foreign, int index, Value value, int64_t* integer, double* number,
+                    char** copy) {
+    switch ((ForeignType) foreign->argumentTypes[index]) {
+        case FOREIGN_DOUBLE:
+            if (!IS_NUMBER(value)) break;
+            *number = AS_NUMBER(value);
+            return true;
+        case FOREIGN_INT32:
+        case FOREIGN_INT64: {
+            if (!IS_NUMBER(value)) break;
+            // Range checked before converting, a cast of NaN, an infinity or anything that does
+            // not fit is undefined
+            bool int32 = foreign->argumentTypes[index] == FOREIGN_INT32;
+            double limit = int32 ? 2147483648.0 : 9223372036854775808.0;
+            double number = AS_NUMBER(value);
+            if (!(number >= -limit && number < limit) || number != (double) (int64_t) number) {
+                runtimeError("Argument %d of %s must be an integer that fits in %s", index + 1,
+                    foreign->name->chars, int32 ? "int32" : "int64");
+                return false;
+            }
+            *integer = (int64_t) number;
+            return true;
+        }
+        case FOREIGN_POINTER: {
+            if (IS_NIL(value)) {
+                *integer = 0;
+                return true;
+            }
+            if (!IS_NUMBER(value)) break;
+            double number = AS_NUMBER(value);
+            if (!(number >= 0 && number < 18446744073709551616.0) || number != (double) (uintptr_t) number) {
+                runtimeError("Argument %d of %s must be nil or a non-negative integer address", index + 1,
+                    foreign->name->chars);
+                return false;
+            }
+            *integer = (int64_t) (uintptr_t) number;
+            return true;
+        }
+        case FOREIGN_STRING:
+            if (!IS_STRING(value)) break;
+            *copy = copyCString(AS_STRING(value));
+            *integer = (int64_t) (uintptr_t) *copy;
+            return true;
+        case FOREIGN_VOID:
+            break;
+    }
+    runtimeError("Argument %d of %s has the wrong type", index + 1, foreign->name->chars);
+    return false;
+}
+#endif
+
+bool callForeign(ObjForeign* foreign, int argumentCount) {
+#ifndef FOREIGN_SUPPORTED
+    runtimeError("Foreign calls are not supported on this platform");
+    return false;
+#else
+    if (argumentCount != foreign->arity) {
+        runtimeError("Incorrect number of arguments passed into %s", foreign->name->chars);
+        return false;
+    }
+    // The arguments are read where they are on the stack, straight into registers
+    Value* arguments = vm.stackTop - argumentCount;
+    int64_t integers[FOREIGN_MAX_INTEGERS] = {0};
+    double doubles[FOREIGN_MAX_DOUBLES] = {0};
+    char* copies[FOREIGN_MAX_INTEGERS] = {NULL};
+    int integerCount = 0;
+    int doubleCount = 0;
+    bool marshalled = true;
+    for (int i = 0; i < argumentCount && marshalled; i++) {
+        if (foreign->argumentTypes[i] == FOREIGN_DOUBLE) {
+            marshalled = marshal(foreign, i, arguments[i], NULL, &doubles[doubleCount++], NULL);
+        } else {
+            marshalled = marshal(foreign, i, arguments[i], &integers[integerCount], NULL,
+                &copies[integerCount]);
+            integerCount++;
+        }
+    }
+
+    int64_t integerResult = 0;
+    double doubleResult = 0;
+    if (marshalled) {
+        if (foreign->returnType == FOREIGN_DOUBLE) {
+            doubleResult = ((DoubleCall) foreign->symbol)(
+                integers[0], integers[1], integers[2], integers[3], integers[4], integers[5],
+                doubles[0], doubles[1], doubles[2], doubles[3], doubles[4], doubles[5], doubles[6], doubles[7]);
+        } else {
+            integerResult = ((IntegerCall) foreign->symbol)(
+                integers[0], integers[1], integers[2], integers[3], integers[4], integers[5],
+                doubles[0], doubles[1], doubles[2], doubles[3], doubles[4], doubles[5], doubles[6], doubles[7]);
+        }
+    }
+    for (int i = 0; i < integerCount; i++) free(copies[i]);
+    if (!marshalled) return false;
+
+    Value result;
+    switch ((ForeignType) foreign->returnType) {
+        case FOREIGN_VOID: result = NIL_VAL; break;
+        case FOREIGN_DOUBLE: result = NUMBER_VAL(doubleResult); break;
+        case FOREIGN_INT32: result = NUMBER_VAL((int32_t) integerResult); break;
+        case FOREIGN_INT64: result = NUMBER_VAL((double) integerResult); break;
+        case FOREIGN_POINTER:
+            result = integerResult == 0 ? NIL_VAL : NUMBER_VAL((double) (uintptr_t) integerResult);
+            break;
+        case FOREIGN_STRING: {
+            // Copied, the C side keeps its own string
+            const char* chars = (const char*) (uintptr_t) integerResult;
+            if (chars == NULL) {
+                result = NIL_VAL;
+                break;
+            }
+            int length = (int) strlen(chars);
+            ObjString* string = newDataString(length);
+            memcpy(string->chars, chars, length);
+            result = OBJ_VAL(string);
+            break;
+        }
+    }
+    vm.stackTop = arguments;
+    vm.stackTop[-1] = result;
+    return true;
+#endif
+}
@@ -0,0 +1,16 @@
+//
+// Created by Yuriy Kulinchenko on 18/10/2026.
+//
+
+#ifndef clox_foreign_h
+#define clox_foreign_h
+
+#include "common.h"
+#include "object.h"
+
+// Registers foreign(library, symbol, signature), which binds a C function to call from Lox
+void initForeign();
+// The function and its arguments are on the stack, the result replaces the function
+bool callForeign(ObjForeign* foreign, int argumentCount);
+
+#endif
@@ -0,0 +1,97 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hash.h"
+
+// wyhash: 8 bytes per step folded with 64x64->128 bit multiplies, keyed by a seed. Without
+// the seed nobody can work out which strings collide, so crafted keys cannot turn table
+// probes into linear scans
+static const uint64_t secret[4] = {
+    0x2d358dccaa6c78a5ull, 0x8bb84b93962eacc9ull, 0x4b33a62ed433d4a3ull, 0x4d5a2da51de1aa47ull
+};
+
+static uint64_t seed;
+
+static inline uint64_t mix(uint64_t a, uint64_t b) {
+    // Both halves of the full product, xored
+    unsigned __int128 product = (unsigned __int128) a * b;
+    return (uint64_t) product ^ (uint64_t) (product >> 64);
+}
+
+static inline uint64_t read64(const uint8_t* p) {
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint64_t read32(const uint8_t* p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+void initHashSeed() {
+    const char* fixed = getenv(HASH_SEED_VARIABLE);
+    if (fixed != NULL && *fixed != '\0') {
+        seed = strtoull(fixed, NULL, 0);
+    } else {
+        FILE* random = fopen("/dev/urandom", "rb");
+        if (random == NULL || fread(&seed, sizeof(seed), 1, random) != 1) {
+            // Still differs between runs, just not unpredictably
+            seed = (uint64_t) time(NULL) ^ (uint64_t) getpid() << 32 ^ (uint64_t) (uintptr_t) &seed;
+        }
+        if (random != NULL) fclose(random);
+    }
+    seed ^= mix(seed ^ secret[0], secret[1]);
+}
+
+uint32_t hashBytes(const char* key, int length) {
+    const uint8_t* p = (const uint8_t*) key;
+    size_t remaining = (size_t) length;
+    uint64_t state = seed;
+    uint64_t a, b;
+    if (remaining <= 16) {
+        // Overlapping reads cover 4 to 16 bytes without a loop
+        if (remaining >= 4) {
+            size_t middle = (remaining >> 3) << 2;
+            a = read32(p) << 32 | read32(p + middle);
+            b = read32(p + remaining - 4) << 32 | read32(p + remaining - 4 - middle);
+        } else if (remaining > 0) {
+            a = (uint64_t) p[0] << 16 | (uint64_t) p[remaining >> 1] << 8 | p[remaining - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        if (remaining >= 48) {
+            uint64_t second = state;
+            uint64_t third = state;
+            do {
+                state = mix(read64(p) ^ secret[1], read64(p + 8) ^ state);
+                second = mix(read64(p + 16) ^ secret[2], read64(p + 24) ^ second);
+                third = mix(read64(p + 32) ^ secret[3], read64(p + 40) ^ third);
+                p += 48;
+                remaining -= 48;
+            } while (remaining >= 48);
+            state ^= second ^ third;
+        }
+        while (remaining > 16) {
+            state = mix(read64(p) ^ secret[1], read64(p + 8) ^ state);
+            p += 16;
+            remaining -= 16;
+        }
+        // The last 16 bytes, overlapping what was already mixed when the length is odd
+        a = read64(p + remaining - 16);
+        b = read64(p + remaining - 8);
+    }
+
+    a ^= secret[1];
+    b ^= state;
+    unsigned __int128 product = (unsigned __int128) a * b;
+    a = (uint64_t) product;
+    b = (uint64_t) (product >> 64);
+    return (uint32_t) mix(a ^ secret[0] ^ (uint64_t) length, b ^ secret[1]);
+}
@@ -0,0 +1,16 @@
+//
+// Created by Yuriy Kulinchenko on 18/10/2026.
+//
+
+#ifndef clox_hash_h
+#define clox_hash_h
+
+#include "common.h"
+
+// Environment variable holding a fixed hash seed, so table layouts can be reproduced
+#define HASH_SEED_VARIABLE "LOX_HASH_SEED"
+
+void initHashSeed();
+uint32_t hashBytes(const char* key, int length);
+
+#endif
@@ -0,0 +1,61 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lint.h"
+#include "memory.h"
+
+void initLintReport(LintReport* report) {
+    report->findings = NULL;
+    report->count = 0;
+    report->capacity = 0;
+}
+
+void freeLintReport(LintReport* report) {
+    for (int i = 0; i < report->count; i++) {
+        free(report->findings[i].message);
+    }
+    FREE_ARRAY(LintFinding, report->findings, report->capacity);
+    initLintReport(report);
+}
+
+void addLintFinding(LintReport* report, int line, LintSeverity severity, const char* format, ...) {
+    char message[256];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+
+    // A function parsed twice for wide jumps reports everything twice
+    for (int i = 0; i < report->count; i++) {
+        LintFinding* finding = &report->findings[i];
+        if (finding->line == line && strcmp(finding->message, message) == 0) return;
+    }
+
+    if (report->capacity < report->count + 1) {
+        int oldCapacity = report->capacity;
+        report->capacity = oldCapacity < 8 ? 8 : oldCapacity * 2;
+        report->findings = GROW_ARRAY(LintFinding, report->findings, oldCapacity, report->capacity);
+    }
+    report->findings[report->count++] = (LintFinding) {
+        .line = line, .severity = severity, .message = strdup(message)
+    };
+}
+
+static int compareFindings(const void* a, const void* b) {
+    const LintFinding* first = a;
+    const LintFinding* second = b;
+    if (first->line != second->line) return first->line - second->line;
+    return (int) second->severity - (int) first->severity;
+}
+
+void printLintReport(LintReport* report, const char* path) {
+    static const char* severityNames[] = {"low", "medium", "high"};
+    qsort(report->findings, report->count, sizeof(LintFinding), compareFindings);
+    for (int i = 0; i < report->count; i++) {
+        LintFinding* finding = &report->findings[i];
+        printf("%s:%d: %s: %s\n", path, finding->line, severityNames[finding->severity], finding->message);
+    }
+    printf("%d finding%s\n", report->count, report->count == 1 ? "" : "s");
+}
@@ -0,0 +1,34 @@
+//
+// Created by Yuriy Kulinchenko on 18/10/2026.
+//
+
+#ifndef clox_lint_h
+#define clox_lint_h
+
+#include "common.h"
+
+typedef enum {
+    SEVERITY_LOW,
+    SEVERITY_MEDIUM,
+    SEVERITY_HIGH,
+} LintSeverity;
+
+typedef struct {
+    int line;
+    LintSeverity severity;
+    char* message;
+} LintFinding;
+
+// Slow patterns the compiler noticed while linting, see setPerfLint()
+typedef struct {
+    LintFinding* findings;
+    int count;
+    int capacity;
+} LintReport;
+
+void initLintReport(LintReport* report);
+void freeLintReport(LintReport* report);
+void addLintFinding(LintReport* report, int line, LintSeverity severity, const char* format, ...);
+void printLintReport(LintReport* report, const char* path);
+
+#endif
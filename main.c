@@ -3,15 +3,21 @@
 #include "stdio.h"
 #include "debug.h"
 #include "vm.h"
+#include "compiler.h"
+#include "cache.h"
+#include "scanner.h"
+#include "source.h"
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
-
-#define QUICK_RUN
+#include <time.h>
 
 static void repl() {
+    // Every line is read into the same buffer, so deferred function bodies would not survive
+    setLazyCompilation(false);
     char line[1024];
     for (;;) {
+        flushOutput();
         printf("> ");
 
         if (!fgets(line, sizeof(line), stdin)) {
@@ -23,42 +29,62 @@ static void repl() {
     }
 }
 
-static char* readFile(const char* path) {
-    FILE* file = fopen(path, "rb");
-    if (file == NULL) {
-        fprintf(stderr, "Could not open file \"%s\".\n", path);
-        exit(74);
-    }
-
-    fseek(file, 0L, SEEK_END);
-    size_t fileSize = ftell(file);
-    rewind(file);
-
-    char* buffer = malloc(fileSize + 1);
-    if (buffer == NULL) {
-        fprintf(stderr, "Not enough memory to read \"%s\".\n");
-        exit(74);
-    }
-    size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
-    if (bytesRead < fileSize) {
+static Source readSource(const char* path) {
+    Source source;
+    if (!openSource(path, &source)) {
         fprintf(stderr, "Could not read file \"%s\".\n", path);
         exit(74);
     }
-    buffer[bytesRead] = '\0';
-
-    fclose(file);
-    return buffer;
+    return source;
 }
 
 static void runFile(const char* path) {
-    char* source = readFile(path);
-    InterpretResult result = interpret(source);
-    free(source);
+    Source source = readSource(path);
+    InterpretResult result = interpretFile(path, source.chars);
+    closeSource(&source);
+    flushOutput();
 
     if (result == INTERPRET_COMPILE_ERROR) exit(65);
     if (result == INTERPRET_RUNTIME_ERROR) exit(70);
 }
 
+static void benchmarkScanner(const char* path) {
+    // Scans the whole file repeatedly and reports the best pass, nothing is compiled
+    Source source = readSource(path);
+    long tokens = 0;
+    double best = 0;
+    for (int pass = 0; pass < 10; pass++) {
+        clock_t start = clock();
+        initScanner(source.chars);
+        tokens = 0;
+        while (scanToken().type != TOKEN_EOF) tokens++;
+        double seconds = (double) (clock() - start) / CLOCKS_PER_SEC;
+        if (best == 0 || seconds < best) best = seconds;
+    }
+    if (best <= 0) best = 1.0 / CLOCKS_PER_SEC;
+
+    printf("%ld tokens, %.1f Mtokens/s, %.0f MB/s\n", tokens, tokens / best / 1e6,
+        source.length / best / 1e6);
+    closeSource(&source);
+}
+
+static void lintFile(const char* path) {
+    // Only compiles the script, every function body included, and reports the patterns the
+    // compiler flagged. Nothing runs and imports are not followed
+    Source source = readSource(path);
+    LintReport report;
+    initLintReport(&report);
+    setLazyCompilation(false);
+    setPerfLint(&report);
+    ObjFunction* function = compile(source.chars);
+    setPerfLint(NULL);
+
+    if (function != NULL) printLintReport(&report, path);
+    freeLintReport(&report);
+    closeSource(&source);
+    if (function == NULL) exit(65);
+}
+
 #include "table.h"
 #include "object.h"
 
@@ -79,20 +105,37 @@ void tableDeleteCustom(Table *table, char* chars) {
 }
 
 int main(int argc, const char* argv[]) {
-#ifdef QUICK_RUN
     initVM();
-    runFile("../exampleCode.txt");
-    freeVM();
-    return 0;
-#endif
-    if (argc == 1) {
-        repl();
+    const char* path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--lazy") == 0) {
+            setLazyCompilation(true);
+        } else if (strcmp(argv[i], "--cache-dir") == 0 && i + 1 < argc) {
+            setCacheDirectory(argv[++i]);
+        } else if (strcmp(argv[i], "--unbuffered") == 0) {
+            setUnbufferedOutput(true);
+        } else if (strcmp(argv[i], "--output-buffer") == 0 && i + 1 < argc) {
+            setOutputBuffer(atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--scan-bench") == 0 && i + 1 < argc) {
+            benchmarkScanner(argv[++i]);
+            freeVM();
+            return 0;
+        } else if (strcmp(argv[i], "--lint-perf") == 0 && i + 1 < argc) {
+            lintFile(argv[++i]);
+            freeVM();
+            return 0;
+        } else if (path == NULL) {
+            path = argv[i];
+        } else {
+            fprintf(stderr, "Usage: clox [--lazy] [--cache-dir dir] [--unbuffered] [--output-buffer bytes] [--scan-bench path] [--lint-perf path] [path | -]\n");
+            exit(64);
+        }
+    }
 
-    } else if (argc == 2) {
-        runFile(argv[1]);
+    if (path == NULL) {
+        repl();
     } else {
-        fprintf(stderr, "Usage: clox[path]\n");
-        exit(64);
+        runFile(path);
     }
 
     freeVM();
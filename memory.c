@@ -8,10 +8,22 @@
 
 #define GC_HEAP_GROW_FACTOR 2
 
+void lockHeap() {
+    // Only needed while worker threads compile modules, the recursive mutex lets interning
+    // allocate while it holds the lock
+    if (vm.heapShared) pthread_mutex_lock(&vm.heapLock);
+}
+
+void unlockHeap() {
+    if (vm.heapShared) pthread_mutex_unlock(&vm.heapLock);
+}
+
 void* reallocate(void* p, size_t oldSize, size_t newSize) {
+    lockHeap();
     vm.bytesAllocated += newSize - oldSize;
 
-    if (newSize > oldSize) {
+    // Collection waits until the workers are done, their half built functions are not roots
+    if (newSize > oldSize && !vm.heapShared && !vm.collecting) {
 #ifdef DEBUG_STRESS_GC
     collectGarbage();
 #endif
@@ -19,6 +31,7 @@ void* reallocate(void* p, size_t oldSize, size_t newSize) {
             collectGarbage();
         }
     }
+    unlockHeap();
 
     if (newSize == 0) {
         free(p);
@@ -36,13 +49,29 @@ static void freeObject(Obj* object) {
     switch (object->type) {
         case OBJ_STRING: {
             ObjString* string = (ObjString*) object;
-            FREE_ARRAY(char, string->chars, string->length + 1);
-            FREE(ObjString, object);
+            switch ((StringStorage) string->storage) {
+                case STRING_INLINE:
+                    reallocate(object, sizeof(ObjString) + string->length + 1, 0);
+                    break;
+                case STRING_OWNED:
+                    FREE_ARRAY(char, string->chars, string->length + 1);
+                    FREE(ObjString, object);
+                    break;
+                case STRING_ROPE:
+                    // A rope that was never flattened has no characters of its own
+                    if (string->chars != NULL) FREE_ARRAY(char, string->chars, string->length + 1);
+                    FREE(ObjRope, object);
+                    break;
+                case STRING_SLICE:
+                    FREE(ObjSlice, object);
+                    break;
+            }
             break;
         }
         case OBJ_FUNCTION: {
             ObjFunction* function = (ObjFunction*) object;
             freeChunk(&function->chunk);
+            freeLazyBody(function);
             FREE(ObjFunction, object);
             break;
         }
@@ -85,6 +114,24 @@ static void freeObject(Obj* object) {
             FREE(ObjBoundMethod, object);
             break;
         }
+
+        case OBJ_MODULE: {
+            ObjModule* module = (ObjModule*) object;
+            freeTable(&module->globals);
+            if (module->source.chars != NULL) closeSource(&module->source);
+            FREE(ObjModule, object);
+            break;
+        }
+
+        case OBJ_NATIVE: {
+            FREE(ObjNative, object);
+            break;
+        }
+
+        case OBJ_FOREIGN: {
+            FREE(ObjForeign, object);
+            break;
+        }
     }
 }
 
@@ -144,7 +191,12 @@ static void markRoots() {
     }
 
     markTable(&vm.globals);
+    markTable(&vm.modules);
     markObject((Obj*)vm.initString);
+    markTable(&vm.stringMethods);
+    markTable(&vm.arrayMethods);
+    markTable(&vm.natives);
+    markTable(&vm.foreignFunctions);
     markCompilerRoots();
 }
 
@@ -159,6 +211,7 @@ static void blackenObject(Obj* object) {
         case OBJ_FUNCTION: {
             const ObjFunction* function = (ObjFunction*) object;
             markObject((Obj*)function->name);
+            markObject((Obj*)function->module);
             for (int i = 0; i < function->chunk.constants.count; i++) {
                 markValue(function->chunk.constants.values[i]);
             }
@@ -167,7 +220,7 @@ static void blackenObject(Obj* object) {
 
         case OBJ_ARRAY: {
             const ObjArray* array = (ObjArray*) object;
-            for (int i = 0; i < array->valueArray.count; i++) {
+            for (size_t i = 0; i < array->valueArray.count; i++) {
                 const Value value = array->valueArray.values[i];
                 markValue(value);
             }
@@ -193,6 +246,7 @@ static void blackenObject(Obj* object) {
             ObjClass* klass = (ObjClass*) object;
             markObject((Obj*)klass->name);
             markTable(&klass->methods);
+            markValue(klass->initializer); // Kept out of the methods table
             break;
         }
 
@@ -210,7 +264,35 @@ static void blackenObject(Obj* object) {
             break;
         }
 
-        case OBJ_STRING: break;
+        case OBJ_MODULE: {
+            ObjModule* module = (ObjModule*) object;
+            markObject((Obj*)module->path);
+            markObject((Obj*)module->function);
+            markTable(&module->globals);
+            break;
+        }
+
+        case OBJ_NATIVE: {
+            markObject((Obj*)((ObjNative*) object)->name);
+            break;
+        }
+
+        case OBJ_FOREIGN: {
+            markObject((Obj*)((ObjForeign*) object)->name);
+            break;
+        }
+
+        case OBJ_STRING: {
+            ObjString* string = (ObjString*) object;
+            if (string->storage == STRING_ROPE && string->chars == NULL) {
+                ObjRope* rope = (ObjRope*) string;
+                markObject((Obj*)rope->left);
+                markObject((Obj*)rope->right);
+            } else if (string->storage == STRING_SLICE) {
+                markObject((Obj*)((ObjSlice*) string)->parent);
+            }
+            break;
+        }
     }
 }
 
@@ -250,13 +332,18 @@ void collectGarbage() {
     printf("-- GC begin\n");
     size_t oldAmount = vm.bytesAllocated;
 #endif
+    vm.collecting = true;
 
     markRoots();
     trackReferences();
     tableRemoveWhite(&vm.strings);
     sweep();
 
+    // Rehashing allocates the new slots before freeing the old ones, which must not collect
+    // again while the table is half moved
+    tableCompact(&vm.strings);
     vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+    vm.collecting = false;
 #ifdef DEBUG_LOG_GC
     printf("-- GC end\n");
     printf("-- GC freed %d bytes of memory\n", (int) (oldAmount - vm.bytesAllocated));
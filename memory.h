@@ -22,5 +22,7 @@ void markValue(Value value);
 void markObject(Obj* object);
 void* reallocate(void* p, size_t oldSize, size_t newSize);
 void freeObjects();
+void lockHeap();
+void unlockHeap();
 
 #endif
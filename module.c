@@ -0,0 +1,253 @@
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "module.h"
+#include "cache.h"
+#include "compiler.h"
+#include "memory.h"
+#include "vm.h"
+
+#define MAX_IMPORT_WORKERS 8
+
+// Modules found by pre-scanning import statements, compiled by worker threads before the
+// script starts. Jobs are only appended, next is the first one no worker has taken yet.
+// A module that fails here is only a miss, the import retries it when it runs, since the
+// pre-scan also finds imports in code that never runs
+typedef struct {
+    ObjModule** jobs;
+    int count;
+    int capacity;
+    int next;
+    int active;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} ImportQueue;
+
+static ImportQueue queue = {
+    .jobs = NULL, .count = 0, .capacity = 0, .next = 0, .active = 0,
+    .lock = PTHREAD_MUTEX_INITIALIZER, .changed = PTHREAD_COND_INITIALIZER
+};
+static pthread_t workers[MAX_IMPORT_WORKERS];
+static int workerCount = 0;
+
+ObjFunction* loadFunction(const char* source) {
+    // The cache builds functions on the VM stack, so it runs under the heap lock
+    lockHeap();
+    ObjFunction* function = loadCachedFunction(source);
+    unlockHeap();
+    if (function == NULL) {
+        function = compile(source);
+        lockHeap();
+        if (function != NULL) storeCachedFunction(source, function);
+        unlockHeap();
+    }
+    return function;
+}
+
+void assignModule(ObjFunction* function, ObjModule* module) {
+    // Nested functions are constants of the function around them
+    function->module = module;
+    for (int i = 0; i < function->chunk.constants.count; i++) {
+        Value constant = function->chunk.constants.values[i];
+        if (IS_FUNCTION(constant)) assignModule(AS_FUNCTION(constant), module);
+    }
+}
+
+static char* resolvePath(ObjModule* importer, const char* path, int length) {
+    // Imports are relative to the importing file, or the working directory for the REPL
+    char joined[PATH_MAX];
+    const char* directory = NULL;
+    int directoryLength = 0;
+    if (path[0] != '/' && importer != NULL) {
+        directory = importer->path->chars;
+        const char* slash = strrchr(directory, '/');
+        directoryLength = slash == NULL ? 0 : (int) (slash - directory) + 1;
+    }
+    if (directoryLength + length + 1 > PATH_MAX) return NULL;
+    memcpy(joined, directory, directoryLength);
+    memcpy(joined + directoryLength, path, length);
+    joined[directoryLength + length] = '\0';
+    return realpath(joined, NULL);
+}
+
+static ObjModule* addModule(const char* canonicalPath, bool* added) {
+    // Returns the module already registered under the path, or a new empty one
+    lockHeap();
+    ObjString* key = copyString((char*) canonicalPath, (int) strlen(canonicalPath));
+    push(OBJ_VAL(key));
+    Value existing;
+    ObjModule* module;
+    *added = !tableGet(&vm.modules, key, &existing);
+    if (*added) {
+        module = newModule(key);
+        push(OBJ_VAL(module));
+        tableSet(&vm.modules, key, OBJ_VAL(module));
+        pop();
+    } else {
+        module = AS_MODULE(existing);
+    }
+    pop();
+    unlockHeap();
+    return module;
+}
+
+static const char* skipSpace(const char* current) {
+    for (;;) {
+        if (*current == ' ' || *current == '\t' || *current == '\r' || *current == '\n') {
+            current++;
+        } else if (current[0] == '/' && current[1] == '/') {
+            while (*current != '\n' && *current != '\0') current++;
+        } else {
+            return current;
+        }
+    }
+}
+
+static bool isIdentifierChar(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+}
+
+static void enqueueImport(ObjModule* importer, const char* path, int length) {
+    char* canonicalPath = resolvePath(importer, path, length);
+    if (canonicalPath == NULL) return;
+
+    bool added;
+    ObjModule* module = addModule(canonicalPath, &added);
+    free(canonicalPath);
+    if (!added) return;
+
+    pthread_mutex_lock(&queue.lock);
+    if (queue.capacity < queue.count + 1) {
+        queue.capacity = queue.capacity < 8 ? 8 : queue.capacity * 2;
+        queue.jobs = realloc(queue.jobs, sizeof(ObjModule*) * queue.capacity);
+        if (queue.jobs == NULL) exit(1);
+    }
+    queue.jobs[queue.count++] = module;
+    pthread_cond_signal(&queue.changed);
+    pthread_mutex_unlock(&queue.lock);
+}
+
+static void findImports(ObjModule* importer, const char* source) {
+    // A plain text pass rather than the scanner, which belongs to whoever is compiling on
+    // this thread. Only needs to tell code apart from comments and strings
+    const char* current = source;
+    while (*current != '\0') {
+        if (current[0] == '/' && current[1] == '/') {
+            while (*current != '\n' && *current != '\0') current++;
+        } else if (*current == '"') {
+            current++;
+            while (*current != '"' && *current != '\0') current++;
+            if (*current == '"') current++;
+        } else if (isIdentifierChar(*current)) {
+            const char* start = current;
+            while (isIdentifierChar(*current)) current++;
+            if (current - start != 6 || memcmp(start, "import", 6) != 0) continue;
+
+            const char* path = skipSpace(current);
+            if (*path != '"') continue;
+            const char* end = path + 1;
+            while (*end != '"' && *end != '\0') end++;
+            if (*end != '"') return;
+            enqueueImport(importer, path + 1, (int) (end - path - 1));
+            current = end + 1;
+        } else {
+            current++;
+        }
+    }
+}
+
+static bool loadModule(ObjModule* module, bool prefetching) {
+    // Prefetching follows the module's own imports and reports nothing
+    if (!openSource(module->path->chars, &module->source)) {
+        if (!prefetching) fprintf(stderr, "Could not open module \"%s\".\n", module->path->chars);
+        return false;
+    }
+
+    if (prefetching) findImports(module, module->source.chars);
+    ObjFunction* function = loadFunction(module->source.chars);
+    if (function == NULL) {
+        closeSource(&module->source);
+        return false;
+    }
+
+    lockHeap();
+    assignModule(function, module);
+    module->function = function;
+    unlockHeap();
+    return true;
+}
+
+static void* importWorker(void* unused) {
+    setSilentErrors(true);
+    pthread_mutex_lock(&queue.lock);
+    for (;;) {
+        // Wait while other workers may still find more imports
+        while (queue.next == queue.count && queue.active > 0) {
+            pthread_cond_wait(&queue.changed, &queue.lock);
+        }
+        if (queue.next == queue.count) break;
+
+        ObjModule* module = queue.jobs[queue.next++];
+        queue.active++;
+        pthread_mutex_unlock(&queue.lock);
+
+        loadModule(module, true);
+
+        pthread_mutex_lock(&queue.lock);
+        queue.active--;
+        pthread_cond_broadcast(&queue.changed);
+    }
+    pthread_mutex_unlock(&queue.lock);
+    // Only matters when there was no thread and the main thread did the work
+    setSilentErrors(false);
+    return NULL;
+}
+
+void beginImports(ObjModule* importer, const char* source) {
+    // Finds the imports of a script about to be compiled and starts compiling them on
+    // worker threads, which keep following their own imports
+    queue.count = 0;
+    queue.next = 0;
+    queue.active = 0;
+    findImports(importer, source);
+    if (queue.count == 0) return;
+
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+    workerCount = processors < 1 ? 1 : processors > MAX_IMPORT_WORKERS ? MAX_IMPORT_WORKERS : (int) processors;
+    vm.heapShared = true;
+    for (int i = 0; i < workerCount; i++) {
+        if (pthread_create(&workers[i], NULL, importWorker, NULL) != 0) {
+            workerCount = i;
+            break;
+        }
+    }
+    // Without any thread the modules are compiled right here
+    if (workerCount == 0) importWorker(NULL);
+}
+
+void endImports() {
+    for (int i = 0; i < workerCount; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    workerCount = 0;
+    vm.heapShared = false;
+}
+
+ObjModule* findModule(ObjModule* importer, ObjString* path) {
+    // Modules are normally compiled by beginImports(), this loads what it missed and retries
+    // what failed there, this time reporting why
+    char* canonicalPath = resolvePath(importer, path->chars, path->length);
+    if (canonicalPath == NULL) return NULL;
+    bool added;
+    ObjModule* module = addModule(canonicalPath, &added);
+    free(canonicalPath);
+    if (module->function == NULL && module->state == MODULE_LOADED) {
+        // Its errors go to stderr, after whatever the script printed so far
+        flushOutput();
+        if (!loadModule(module, false)) return NULL;
+    }
+    return module;
+}
@@ -0,0 +1,17 @@
+//
+// Created by Yuriy Kulinchenko on 18/10/2026.
+//
+
+#ifndef clox_module_h
+#define clox_module_h
+
+#include "object.h"
+
+ObjFunction* loadFunction(const char* source);
+void assignModule(ObjFunction* function, ObjModule* module);
+
+void beginImports(ObjModule* importer, const char* source);
+void endImports();
+ObjModule* findModule(ObjModule* importer, ObjString* path);
+
+#endif
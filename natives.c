@@ -0,0 +1,121 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "natives.h"
+#include "number.h"
+#include "object.h"
+#include "vm.h"
+
+static bool numberArgument(Value value, const char* native, double* number) {
+    if (!IS_NUMBER(value)) {
+        runtimeError("Argument of %s must be a number", native);
+        return false;
+    }
+    *number = AS_NUMBER(value);
+    return true;
+}
+
+static bool clockNative(int argumentCount, Value* arguments, Value* result) {
+    // Processor time in seconds
+    *result = NUMBER_VAL((double) clock() / CLOCKS_PER_SEC);
+    return true;
+}
+
+static bool clockNsNative(int argumentCount, Value* arguments, Value* result) {
+    // Wall time in nanoseconds from a clock that never goes back, only differences mean anything.
+    // A double holds whole nanoseconds exactly for over 100 days
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    *result = NUMBER_VAL((double) now.tv_sec * 1e9 + (double) now.tv_nsec);
+    return true;
+}
+
+static bool sqrtNative(int argumentCount, Value* arguments, Value* result) {
+    double number;
+    if (!numberArgument(arguments[0], "sqrt", &number)) return false;
+    *result = NUMBER_VAL(sqrt(number));
+    return true;
+}
+
+static bool floorNative(int argumentCount, Value* arguments, Value* result) {
+    double number;
+    if (!numberArgument(arguments[0], "floor", &number)) return false;
+    *result = NUMBER_VAL(floor(number));
+    return true;
+}
+
+static bool lenNative(int argumentCount, Value* arguments, Value* result) {
+    if (IS_STRING(arguments[0])) {
+        *result = NUMBER_VAL(AS_STRING(arguments[0])->length);
+    } else if (IS_ARRAY(arguments[0])) {
+        *result = NUMBER_VAL(AS_ARRAY(arguments[0])->valueArray.count);
+    } else {
+        runtimeError("Argument of len must be a string or an array");
+        return false;
+    }
+    return true;
+}
+
+static bool strNative(int argumentCount, Value* arguments, Value* result) {
+    // A string is returned as it is, anything else as print would write it
+    if (IS_STRING(arguments[0])) {
+        *result = arguments[0];
+        return true;
+    }
+    Writer writer;
+    initWriter(&writer, NULL, 0, NULL);
+    writeValue(&writer, arguments[0]);
+    ObjString* string = newDataString(writer.length);
+    memcpy(string->chars, writer.chars, writer.length);
+    free(writer.chars);
+    *result = OBJ_VAL(string);
+    return true;
+}
+
+static bool isNumberLiteral(const char* chars, int length) {
+    // Same shape the scanner accepts: digits, then optionally a '.' and more digits
+    int i = 0;
+    while (i < length && chars[i] >= '0' && chars[i] <= '9') i++;
+    if (i == 0) return false;
+    if (i == length) return true;
+    if (chars[i] != '.' || ++i == length) return false;
+    while (i < length && chars[i] >= '0' && chars[i] <= '9') i++;
+    return i == length;
+}
+
+static bool numNative(int argumentCount, Value* arguments, Value* result) {
+    // nil unless the whole string is a number literal, optionally with a leading '-'
+    if (IS_NUMBER(arguments[0])) {
+        *result = arguments[0];
+        return true;
+    }
+    if (!IS_STRING(arguments[0])) {
+        runtimeError("Argument of num must be a string or a number");
+        return false;
+    }
+    ObjString* string = AS_STRING(arguments[0]);
+    const char* chars = stringChars(string);
+    int length = string->length;
+    bool negative = length > 0 && chars[0] == '-';
+    if (negative) {
+        chars++;
+        length--;
+    }
+    *result = NIL_VAL;
+    if (!isNumberLiteral(chars, length)) return true;
+    double number = parseNumber(chars, length);
+    *result = NUMBER_VAL(negative ? -number : number);
+    return true;
+}
+
+void initNatives() {
+    defineNative("clock", clockNative, 0);
+    defineNative("clockNs", clockNsNative, 0);
+    defineNative("sqrt", sqrtNative, 1);
+    defineNative("floor", floorNative, 1);
+    defineNative("len", lenNative, 1);
+    defineNative("str", strNative, 1);
+    defineNative("num", numNative, 1);
+}
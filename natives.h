@@ -0,0 +1,11 @@
+//
+// Created by Yuriy Kulinchenko on 18/10/2026.
+//
+
+#ifndef clox_natives_h
+#define clox_natives_h
+
+// Registers the core natives, every module can call them as globals
+void initNatives();
+
+#endif
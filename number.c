@@ -0,0 +1,224 @@
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "number.h"
+
+// Every power up to 1e22 is exact, so one multiply or divide by them is correctly rounded
+static const double powersOfTen[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+#define MAX_EXACT_POWER 22
+#define MAX_EXACT_INTEGER (1ull << 53)
+
+static double parseLong(const char* start, int length) {
+    // strtod() reads until it finds a non-digit, which for a slice could be past its end
+    char* chars = malloc(length + 1);
+    if (chars == NULL) exit(1);
+    memcpy(chars, start, length);
+    chars[length] = '\0';
+    double value = strtod(chars, NULL);
+    free(chars);
+    return value;
+}
+
+double parseNumber(const char* start, int length) {
+    // Literals are plain digits with an optional fraction. When the digits fit in a double
+    // exactly, one correctly rounded divide gives the same result as strtod()
+    uint64_t mantissa = 0;
+    int digits = 0;
+    int fractionDigits = 0;
+    bool inFraction = false;
+    for (int i = 0; i < length; i++) {
+        char c = start[i];
+        if (c == '.') {
+            inFraction = true;
+            continue;
+        }
+        if (mantissa == 0 && c == '0') {
+            if (inFraction) fractionDigits++;
+            continue;
+        }
+        if (++digits > 19) return parseLong(start, length);
+        mantissa = mantissa * 10 + (c - '0');
+        if (inFraction) fractionDigits++;
+    }
+
+    if (mantissa > MAX_EXACT_INTEGER || fractionDigits > MAX_EXACT_POWER) return parseLong(start, length);
+    return (double) mantissa / powersOfTen[fractionDigits];
+}
+
+static int writeDigits(uint64_t value, char* buffer) {
+    char digits[20];
+    int count = 0;
+    do {
+        digits[count++] = (char) ('0' + value % 10);
+        value /= 10;
+    } while (value != 0);
+
+    for (int i = 0; i < count; i++) buffer[i] = digits[count - 1 - i];
+    return count;
+}
+
+static int writeExponent(int exponent, char* buffer) {
+    // Same shape as printf, a sign and at least two digits
+    int length = 0;
+    buffer[length++] = 'e';
+    buffer[length++] = exponent < 0 ? '-' : '+';
+    if (exponent < 0) exponent = -exponent;
+    if (exponent < 10) buffer[length++] = '0';
+    return length + writeDigits(exponent, buffer + length);
+}
+
+static int formatScientific(const char* digits, int count, int exponent, char* buffer) {
+    int length = 0;
+    buffer[length++] = digits[0];
+    if (count > 1) {
+        buffer[length++] = '.';
+        for (int i = 1; i < count; i++) buffer[length++] = digits[i];
+    }
+    return length + writeExponent(exponent, buffer + length);
+}
+
+static int formatInteger(uint64_t value, char* buffer) {
+    // Matches "%g", six significant digits rounded half to even, then an exponent
+    if (value < 1000000) return writeDigits(value, buffer);
+
+    char digits[20];
+    int count = writeDigits(value, digits);
+    uint64_t divisor = 1;
+    for (int i = 6; i < count; i++) divisor *= 10;
+
+    uint64_t kept = value / divisor;
+    uint64_t rest = value % divisor;
+    if (rest > divisor / 2 || (rest == divisor / 2 && (kept & 1))) kept++;
+    int exponent = count - 1;
+    if (kept == 1000000) {
+        kept = 100000;
+        exponent++;
+    }
+
+    count = writeDigits(kept, digits);
+    while (count > 1 && digits[count - 1] == '0') count--;
+    return formatScientific(digits, count, exponent, buffer);
+}
+
+static int formatDecimal(uint64_t scaled, int fractionDigits, char* buffer) {
+    // Prints scaled / 10^fractionDigits the way "%.*g" would with exactly its digit count
+    char digits[20];
+    int count = writeDigits(scaled, digits);
+    int exponent = count - 1 - fractionDigits;
+    if (exponent < -4) return formatScientific(digits, count, exponent, buffer);
+
+    int length = 0;
+    if (count > fractionDigits) {
+        for (int i = 0; i < count - fractionDigits; i++) buffer[length++] = digits[i];
+        buffer[length++] = '.';
+        for (int i = count - fractionDigits; i < count; i++) buffer[length++] = digits[i];
+    } else {
+        buffer[length++] = '0';
+        buffer[length++] = '.';
+        for (int i = count; i < fractionDigits; i++) buffer[length++] = '0';
+        for (int i = 0; i < count; i++) buffer[length++] = digits[i];
+    }
+    return length;
+}
+
+static int formatFraction(double value, char* buffer) {
+    // Exact shortest digits for a positive non-integer, returns 0 if it is too small to
+    // work out in 128 bits. The double is mantissa * 2^-shift, so value * 10^k is
+    // mantissa * 10^k >> shift and every digit comes out of integer maths
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    int biasedExponent = (int) (bits >> 52 & 0x7ff);
+    uint64_t mantissa = bits & ((1ull << 52) - 1);
+    if (biasedExponent != 0) mantissa |= 1ull << 52;
+    int shift = 1075 - (biasedExponent == 0 ? 1 : biasedExponent);
+    if (shift >= 128) return 0;
+
+    // The gap to the next double down is half as wide at a power of two
+    bool narrowBelow = mantissa == 1ull << 52 && biasedExponent > 1;
+    unsigned __int128 power = 1;
+    unsigned __int128 half = (unsigned __int128) 1 << (shift - 1);
+    for (int fractionDigits = 1; fractionDigits <= MAX_EXACT_POWER; fractionDigits++) {
+        power *= 10;
+        unsigned __int128 scaled = mantissa * power;
+        unsigned __int128 candidate = scaled >> shift;
+        unsigned __int128 distance = scaled - (candidate << shift);
+        bool below = true;
+        if (distance > half || (distance == half && (candidate & 1))) {
+            candidate++;
+            distance = (candidate << shift) - scaled;
+            below = false;
+        }
+        if (candidate == 0) continue;
+
+        // candidate / 10^k reads back as value when it is within half the gap to the
+        // neighbouring double, exact ties go to the even mantissa
+        unsigned __int128 reach = (below && narrowBelow ? 4 : 2) * distance;
+        if (reach < power || (reach == power && (mantissa & 1) == 0)) {
+            uint64_t digits = (uint64_t) candidate;
+            // Rounding up can carry into a trailing zero, e.g. 0.99 -> 1.0
+            while (digits % 10 == 0) {
+                digits /= 10;
+                fractionDigits--;
+            }
+            int length = formatDecimal(digits, fractionDigits, buffer);
+            buffer[length] = '\0';
+            return length;
+        }
+    }
+    return 0;
+}
+
+static int formatShortest(double value, char* buffer) {
+    // Fewest significant digits that still read back as the same double. Round trips only
+    // get more likely with more digits, so the precision can be binary searched. At most 17
+    // digits, sign, point and exponent make 24 chars, so nothing is cut off
+    char digits[NUMBER_BUFFER_SIZE];
+    int low = 1;
+    int high = DBL_DECIMAL_DIG;
+    while (low < high) {
+        int precision = (low + high) / 2;
+        int length = snprintf(digits, sizeof(digits), "%.*g", precision, value);
+        if (length > 0 && length < (int) sizeof(digits) && strtod(digits, NULL) == value) {
+            high = precision;
+        } else {
+            low = precision + 1;
+        }
+    }
+    int length = snprintf(digits, sizeof(digits), "%.*g", low, value);
+    if (length < 0 || length >= (int) sizeof(digits)) length = 0;
+    memcpy(buffer, digits, length);
+    buffer[length] = '\0';
+    return length;
+}
+
+int formatNumber(double value, char* buffer) {
+    // Integers print exactly as "%g" always has, everything else prints the shortest
+    // digits that round trip. Returns the length, the buffer is always terminated
+    if (!isfinite(value)) return snprintf(buffer, NUMBER_BUFFER_SIZE, "%g", value);
+
+    int length = 0;
+    double magnitude = value;
+    if (signbit(value)) {
+        buffer[length++] = '-';
+        magnitude = -value;
+    }
+
+    if (magnitude >= 0x1p63) return snprintf(buffer, NUMBER_BUFFER_SIZE, "%g", value);
+    if (magnitude == (double) (uint64_t) magnitude) {
+        length += formatInteger((uint64_t) magnitude, buffer + length);
+        buffer[length] = '\0';
+        return length;
+    }
+
+    int fractionLength = formatFraction(magnitude, buffer + length);
+    if (fractionLength > 0) return length + fractionLength;
+    return formatShortest(value, buffer);
+}
@@ -0,0 +1,14 @@
+//
+// Created by Yuriy Kulinchenko on 18/10/2026.
+//
+
+#ifndef clox_number_h
+#define clox_number_h
+
+// Longest output of formatNumber(), e.g. "-2.2250738585072014e-308" plus the '\0'
+#define NUMBER_BUFFER_SIZE 32
+
+double parseNumber(const char* start, int length);
+int formatNumber(double value, char* buffer);
+
+#endif
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <string.h>
+#include "hash.h"
 #include "memory.h"
 #include "object.h"
 #include "table.h"
@@ -15,8 +16,10 @@ static Obj* allocateObject(size_t size, ObjType type) {
     object->type = type;
     object->isMarked = false;
 
+    lockHeap();
     object->next = vm.objects;
     vm.objects = object;
+    unlockHeap();
 
 #ifdef DEBUG_LOG_GC
     printf("    allocated: %p\n", (void*) object);
@@ -25,19 +28,21 @@ static Obj* allocateObject(size_t size, ObjType type) {
     return object;
 }
 
-static uint32_t hashString(const char* key, int length) {
-    uint32_t hash = 2166136261u;
-    for (int i = 0; i < length; i++) {
-        hash ^= key[i];
-        hash *= 16777619;
-    }
-    return hash;
-}
-
 static ObjString* allocateString(char* chars, int length, uint32_t hash) {
-    ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+    // A NULL chars stores the characters after the header, in the same allocation
+    ObjString* string;
+    if (chars == NULL) {
+        string = (ObjString*) allocateObject(sizeof(ObjString) + length + 1, OBJ_STRING);
+        string->chars = string->inlineChars;
+        string->storage = STRING_INLINE;
+    } else {
+        string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+        string->chars = chars;
+        string->storage = STRING_OWNED;
+    }
     string->length = length;
-    string->chars = chars;
+    string->interned = true;
+    string->depth = 0;
     string->hash = hash;
 
     push(OBJ_VAL(string));
@@ -48,30 +53,207 @@ static ObjString* allocateString(char* chars, int length, uint32_t hash) {
 }
 
 ObjString* takeString(char* chars, int length) {
-    uint32_t hash = hashString(chars, length);
+    uint32_t hash = hashBytes(chars, length);
+    // Looking up and interning must happen as one step while modules compile in parallel
+    lockHeap();
     ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
     if (interned != NULL) {
+        unlockHeap();
         FREE_ARRAY(char, chars, length + 1);
         return interned;
     }
 
 
-    return allocateString(chars, length, hash);
+    ObjString* string = allocateString(chars, length, hash);
+    unlockHeap();
+    return string;
 }
 
 ObjString* copyString(char* chars, int length) {
     // Goal is to return an object class
     // If the string already exists, the reference to its duplicate is returned
-    uint32_t hash = hashString(chars, length);
+    uint32_t hash = hashBytes(chars, length);
+    lockHeap();
     ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
-    if (interned != NULL) return interned;
+    if (interned != NULL) {
+        unlockHeap();
+        return interned;
+    }
     // Do not assume ownership of chars, it cannot yet be freed
+    ObjString* string = allocateString(NULL, length, hash);
+    memcpy(string->chars, chars, length);
+    string->chars[length] = '\0';
+    unlockHeap();
+    return string;
+}
+
+ObjString* newDataString(int length) {
+    // Runtime results are neither hashed nor interned, the caller fills in the characters
+    ObjString* string = (ObjString*) allocateObject(sizeof(ObjString) + length + 1, OBJ_STRING);
+    string->length = length;
+    string->interned = false;
+    string->storage = STRING_INLINE;
+    string->depth = 0;
+    string->chars = string->inlineChars;
+    string->chars[length] = '\0';
+    return string;
+}
+
+ObjString* internString(ObjString* string) {
+    // Tables key on symbols, so a data string is hashed the first time it is used as a key.
+    // With no symbol for its characters yet, the string itself becomes the symbol
+    if (string->interned) return string;
+    // A symbol must own NUL terminated characters, so a slice is copied
+    if (string->storage == STRING_SLICE) return copyString(string->chars, string->length);
+    char* chars = stringChars(string);
+    uint32_t hash = hashBytes(chars, string->length);
+    lockHeap();
+    ObjString* interned = tableFindString(&vm.strings, chars, string->length, hash);
+    if (interned == NULL) {
+        string->interned = true;
+        string->hash = hash;
+        push(OBJ_VAL(string));
+        tableSet(&vm.strings, string, NIL_VAL);
+        pop();
+        interned = string;
+    }
+    unlockHeap();
+    return interned;
+}
+
+// Short pieces appended to a rope are copied into its last leaf until it is this long
+#define ROPE_LEAF_LENGTH 2048
+// Deeper ropes are rebuilt balanced, which also bounds the recursion when flattening one
+#define ROPE_MAX_DEPTH 48
+
+static int ropeDepth(ObjString* string) {
+    // A flattened rope is a leaf again
+    return string->chars == NULL ? string->depth : 0;
+}
 
+static ObjString* makeRope(ObjString* left, ObjString* right) {
+    ObjRope* rope = ALLOCATE_OBJ(ObjRope, OBJ_STRING);
+    int depth = ropeDepth(left) > ropeDepth(right) ? ropeDepth(left) : ropeDepth(right);
+    rope->string.length = left->length + right->length;
+    rope->string.interned = false;
+    rope->string.storage = STRING_ROPE;
+    rope->string.depth = 1 + depth;
+    rope->string.chars = NULL;
+    rope->left = left;
+    rope->right = right;
+    return (ObjString*) rope;
+}
 
-    char* copiedChars = ALLOCATE(char, length + 1);
-    memcpy(copiedChars, chars, length);
-    copiedChars[length] = '\0';
-    return allocateString(copiedChars, length, hash);
+static int collectLeaves(ObjString* string, ObjString** leaves, int count) {
+    // Stores the leaves in order if leaves is not NULL, returns how many there are
+    if (string->chars != NULL) {
+        if (leaves != NULL) leaves[count] = string;
+        return count + 1;
+    }
+    ObjRope* rope = (ObjRope*) string;
+    count = collectLeaves(rope->left, leaves, count);
+    return collectLeaves(rope->right, leaves, count);
+}
+
+static ObjString* buildBalanced(ObjString** leaves, int count) {
+    // Finished halves wait on the stack while the rest of the tree is allocated
+    if (count == 1) return leaves[0];
+    ObjString* left = buildBalanced(leaves, count / 2);
+    push(OBJ_VAL(left));
+    ObjString* right = buildBalanced(leaves + count / 2, count - count / 2);
+    push(OBJ_VAL(right));
+    ObjString* rope = makeRope(left, right);
+    pop();
+    pop();
+    return rope;
+}
+
+ObjString* newRope(ObjString* left, ObjString* right) {
+    // Both halves must be reachable, the rope shares them rather than copying their characters
+    // Callers check that the joined length fits in STRING_MAX_LENGTH
+    if (left->chars == NULL && right->chars != NULL) {
+        // s = s + piece joins the piece onto the last leaf instead of making the rope deeper
+        ObjRope* spine = (ObjRope*) left;
+        ObjString* tail = spine->right;
+        if (tail->chars != NULL && tail->length + right->length <= ROPE_LEAF_LENGTH) {
+            ObjString* leaf = newDataString(tail->length + right->length);
+            memcpy(leaf->chars, tail->chars, tail->length);
+            memcpy(leaf->chars + tail->length, right->chars, right->length);
+            push(OBJ_VAL(leaf));
+            ObjString* rope = makeRope(spine->left, leaf);
+            pop();
+            return rope;
+        }
+    }
+    if (right->chars == NULL && left->chars != NULL) {
+        // And s = piece + s onto the first leaf
+        ObjRope* spine = (ObjRope*) right;
+        ObjString* head = spine->left;
+        if (head->chars != NULL && left->length + head->length <= ROPE_LEAF_LENGTH) {
+            ObjString* leaf = newDataString(left->length + head->length);
+            memcpy(leaf->chars, left->chars, left->length);
+            memcpy(leaf->chars + left->length, head->chars, head->length);
+            push(OBJ_VAL(leaf));
+            ObjString* rope = makeRope(leaf, spine->right);
+            pop();
+            return rope;
+        }
+    }
+
+    ObjString* rope = makeRope(left, right);
+    if (rope->depth <= ROPE_MAX_DEPTH) return rope;
+
+    // Repeated appends build a rope that is all spine, so it is rebuilt from its leaves
+    push(OBJ_VAL(rope));
+    int count = collectLeaves(rope, NULL, 0);
+    ObjString** leaves = ALLOCATE(ObjString*, count);
+    collectLeaves(rope, leaves, 0);
+    ObjString* balanced = buildBalanced(leaves, count);
+    FREE_ARRAY(ObjString*, leaves, count);
+    pop();
+    return balanced;
+}
+
+static void copyLeaves(ObjString* string, char* destination) {
+    while (string->chars == NULL) {
+        ObjRope* rope = (ObjRope*) string;
+        copyLeaves(rope->left, destination);
+        destination += rope->left->length;
+        string = rope->right;
+    }
+    memcpy(destination, string->chars, string->length);
+}
+
+void flattenString(ObjString* string) {
+    // Afterwards the rope is an ordinary data string and its halves can be collected
+    push(OBJ_VAL(string));
+    char* chars = ALLOCATE(char, string->length + 1);
+    pop();
+    copyLeaves(string, chars);
+    chars[string->length] = '\0';
+    string->chars = chars;
+    ((ObjRope*) string)->left = NULL;
+    ((ObjRope*) string)->right = NULL;
+}
+
+ObjString* newSlice(ObjString* string, int start, int length) {
+    // The string must be reachable. A slice of a slice refers straight to the original
+    char* chars = stringChars(string) + start;
+    if (length < SLICE_MIN_LENGTH) {
+        ObjString* copy = newDataString(length);
+        memcpy(copy->chars, chars, length);
+        return copy;
+    }
+    if (string->storage == STRING_SLICE) string = ((ObjSlice*) string)->parent;
+
+    ObjSlice* slice = ALLOCATE_OBJ(ObjSlice, OBJ_STRING);
+    slice->string.length = length;
+    slice->string.interned = false;
+    slice->string.storage = STRING_SLICE;
+    slice->string.depth = 0;
+    slice->string.chars = chars;
+    slice->parent = string;
+    return (ObjString*) slice;
 }
 
 ObjFunction* newFunction() {
@@ -79,10 +261,20 @@ ObjFunction* newFunction() {
     function->arity = 0;
     function->upvalueCount = 0;
     function->name = NULL;
+    function->lazy = NULL;
+    function->module = NULL;
     initChunk(&function->chunk);
     return function;
 }
 
+void freeLazyBody(ObjFunction* function) {
+    LazyBody* lazy = function->lazy;
+    if (lazy == NULL) return;
+    FREE_ARRAY(Token, lazy->upvalueNames, function->upvalueCount);
+    FREE(LazyBody, lazy);
+    function->lazy = NULL;
+}
+
 ObjClosure* newClosure(ObjFunction* function) {
     ObjClosure* closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
     push(OBJ_VAL(closure));
@@ -105,9 +297,12 @@ ObjUpvalue* newUpvalue(Value* value) {
     return upvalue;
 }
 
-ObjArray* newArray(Value* values, uint8_t count) {
+ObjArray* newArray(Value* values, size_t count) {
     ObjArray* array = ALLOCATE_OBJ(ObjArray, OBJ_ARRAY);
+    initValueArray(&array->valueArray);
+    push(OBJ_VAL(array));
     initValueArrayCopy(&array->valueArray, values, count);
+    pop();
     return array;
 }
 
@@ -131,4 +326,32 @@ ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method) {
     boundMethod->receiver = receiver;
     boundMethod->method = method;
     return boundMethod;
+}
+
+ObjNative* newNative(NativeFn function, ObjString* name, int arity) {
+    ObjNative* native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
+    native->function = function;
+    native->name = name;
+    native->arity = arity;
+    return native;
+}
+
+ObjForeign* newForeign(ObjString* name, void* symbol) {
+    // The caller fills in the signature
+    ObjForeign* foreign = ALLOCATE_OBJ(ObjForeign, OBJ_FOREIGN);
+    foreign->name = name;
+    foreign->symbol = symbol;
+    foreign->returnType = FOREIGN_VOID;
+    foreign->arity = 0;
+    return foreign;
+}
+
+ObjModule* newModule(ObjString* path) {
+    ObjModule* module = ALLOCATE_OBJ(ObjModule, OBJ_MODULE);
+    module->path = path;
+    initTable(&module->globals);
+    module->function = NULL;
+    module->source = (Source) {.chars = NULL, .length = 0, .mappedSize = 0};
+    module->state = MODULE_LOADED;
+    return module;
 }
\ No newline at end of file
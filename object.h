@@ -5,10 +5,14 @@
 #ifndef clox_object_h
 #define clox_object_h
 
+#include <limits.h>
+
 #include "common.h"
 #include "value.h"
 #include "chunk.h"
 #include "table.h"
+#include "scanner.h"
+#include "source.h"
 
 #define OBJ_TYPE(value) (AS_OBJ(value)->type)
 
@@ -19,6 +23,9 @@
 #define IS_CLASS(value) isObjType(value, OBJ_CLASS)
 #define IS_INSTANCE(value) isObjType(value, OBJ_INSTANCE)
 #define IS_BOUND_METHOD(value) isObjType(value, OBJ_BOUND_METHOD)
+#define IS_MODULE(value) isObjType(value, OBJ_MODULE)
+#define IS_NATIVE(value) isObjType(value, OBJ_NATIVE)
+#define IS_FOREIGN(value) isObjType(value, OBJ_FOREIGN)
 
 #define AS_STRING(value) ((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value) (((ObjString*)AS_OBJ(value))->chars)
@@ -28,6 +35,9 @@
 #define AS_CLASS(value) ((ObjClass*)AS_OBJ(value))
 #define AS_INSTANCE(value) ((ObjInstance*)AS_OBJ(value))
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod*)AS_OBJ(value))
+#define AS_MODULE(value) ((ObjModule*)AS_OBJ(value))
+#define AS_NATIVE(value) ((ObjNative*)AS_OBJ(value))
+#define AS_FOREIGN(value) ((ObjForeign*)AS_OBJ(value))
 
 
 typedef enum {
@@ -39,6 +49,9 @@ typedef enum {
     OBJ_CLASS,
     OBJ_INSTANCE,
     OBJ_BOUND_METHOD,
+    OBJ_MODULE,
+    OBJ_NATIVE,
+    OBJ_FOREIGN,
 } ObjType;
 
 
@@ -48,12 +61,25 @@ struct Obj {
     bool isMarked;
 };
 
+typedef struct {
+    // Everything needed to compile a function body on its first call
+    const char* source; // Start of the parameter list, the source must outlive the function
+    int line;
+    uint8_t type; // FunctionType of the deferred compiler
+    bool inClass;
+    Token* upvalueNames; // One name per upvalue, found by pre-scanning the body
+} LazyBody;
+
+typedef struct ObjModule ObjModule;
+
 typedef struct {
     Obj obj;
     int arity;
     int upvalueCount;
     Chunk chunk;
     ObjString* name;
+    LazyBody* lazy; // NULL once the body has been compiled
+    ObjModule* module; // Owner of the globals it uses, NULL for the REPL
 } ObjFunction;
 
 
@@ -95,28 +121,124 @@ typedef struct {
     ObjClosure* method;
 } ObjBoundMethod;
 
+// Arguments are read in place on the VM stack. Returns false after reporting a runtime error
+typedef bool (*NativeFn)(int argumentCount, Value* arguments, Value* result);
+
+// Natives taking any number of arguments
+#define NATIVE_VARIADIC (-1)
+
+typedef struct {
+    Obj obj;
+    NativeFn function;
+    ObjString* name;
+    int arity;
+} ObjNative;
+
+// Integer and pointer arguments, then floating point ones, each go in their own registers
+#define FOREIGN_MAX_INTEGERS 6
+#define FOREIGN_MAX_DOUBLES 8
+#define FOREIGN_MAX_ARGUMENTS (FOREIGN_MAX_INTEGERS + FOREIGN_MAX_DOUBLES)
+
+typedef enum {
+    FOREIGN_VOID, // Return type only
+    FOREIGN_DOUBLE,
+    FOREIGN_INT32,
+    FOREIGN_INT64,
+    FOREIGN_POINTER, // An address held in a number, nil for NULL
+    FOREIGN_STRING, // const char*
+} ForeignType;
+
+typedef struct {
+    // A C function bound from a shared library, its signature parsed once when it is bound
+    Obj obj;
+    ObjString* name;
+    void* symbol;
+    uint8_t returnType;
+    uint8_t argumentTypes[FOREIGN_MAX_ARGUMENTS];
+    int arity;
+} ObjForeign;
+
+typedef enum {
+    MODULE_LOADED,
+    MODULE_RUNNING,
+    MODULE_DONE,
+} ModuleState;
+
+struct ObjModule {
+    Obj obj;
+    ObjString* path; // Canonical path, the key in vm.modules
+    Table globals;
+    ObjFunction* function; // Top level code, NULL if the module failed to load
+    Source source; // Kept for deferred function bodies, empty for the main script
+    ModuleState state;
+};
+
+// Concatenations at least this long share their operands in a rope instead of copying them
+#define ROPE_MIN_LENGTH 512
+// Substrings at least this long share their parent's characters instead of copying them
+#define SLICE_MIN_LENGTH 16
+// String lengths are ints, so nothing longer can be built
+#define STRING_MAX_LENGTH INT_MAX
+
+typedef enum {
+    STRING_INLINE, // Characters follow the header in the same allocation
+    STRING_OWNED, // Characters in a buffer of their own, handed to takeString()
+    STRING_ROPE, // An ObjRope, its buffer is only allocated when it is flattened
+    STRING_SLICE, // An ObjSlice, its characters are part of its parent's
+} StringStorage;
+
 struct ObjString { // Can be safely cast to Obj
     Obj obj;
     int length;
-    char* chars;
-    uint32_t hash;
+    uint32_t hash; // Only set once the string is interned
+    char* chars; // NULL for a rope until it is flattened. Only a slice is not NUL terminated
+    bool interned; // Symbols in vm.strings compare by pointer, data strings built at runtime by content
+    uint8_t storage; // StringStorage
+    uint8_t depth; // Height of the tree for a rope, otherwise zero
+    char inlineChars[]; // Same allocation as the header
 };
 
+typedef struct {
+    ObjString string; // Can be safely cast to ObjString
+    ObjString* left; // Dropped once the rope is flattened
+    ObjString* right;
+} ObjRope;
+
+typedef struct {
+    ObjString string;
+    ObjString* parent; // Never a slice itself, kept alive for as long as the slice is
+} ObjSlice;
+
 ObjFunction* newFunction();
+void freeLazyBody(ObjFunction* function);
 ObjClosure* newClosure(ObjFunction* function);
 ObjUpvalue* newUpvalue(Value* value);
 ObjClass* newClass(ObjString* name);
 ObjInstance* newInstance(ObjClass* klass);
 ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method);
+ObjModule* newModule(ObjString* path);
+ObjNative* newNative(NativeFn function, ObjString* name, int arity);
+ObjForeign* newForeign(ObjString* name, void* symbol);
 
-ObjArray* newArray(Value* values, uint8_t count);
+ObjArray* newArray(Value* values, size_t count);
 
 ObjString* takeString(char* chars, int length);
 ObjString* copyString(char* chars, int length);
+ObjString* newDataString(int length);
+ObjString* internString(ObjString* string);
+ObjString* newRope(ObjString* left, ObjString* right);
+void flattenString(ObjString* string);
+ObjString* newSlice(ObjString* string, int start, int length);
 
 static inline bool isObjType(Value value, ObjType type) {
     if (!IS_OBJ(value)) return false;
     return OBJ_TYPE(value) == type;
 }
 
+static inline char* stringChars(ObjString* string) {
+    // Data strings may be ropes, which are only joined up once their characters are needed
+    if (string->chars == NULL) flattenString(string);
+    return string->chars;
+}
+
 #endif
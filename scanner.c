@@ -5,82 +5,176 @@
 
 #include <ctype.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 typedef struct {
     const char* start;
     const char* current;
     int line;
 } Scanner;
 
-Scanner scanner;
+// Each thread compiling a module scans its own source. The helpers take a pointer to it,
+// reaching the thread local directly on every char was about 10% slower
+_Thread_local Scanner threadScanner;
 
 void initScanner(const char* source) {
-    scanner.start = source;
-    scanner.current = source;
-    scanner.line = 1;
+    initScannerAt(source, 1);
+}
+
+void initScannerAt(const char* source, int line) {
+    // Used to resume scanning part way through a source, e.g. a deferred function body
+    threadScanner.start = source;
+    threadScanner.current = source;
+    threadScanner.line = line;
 }
 
-bool isAtEnd() {
-    return *scanner.current == '\0';
+static bool isAtEnd(Scanner* scanner) {
+    return *scanner->current == '\0';
 }
 
-Token makeToken(TokenType type) {
+static Token makeToken(Scanner* scanner, TokenType type) {
     Token token;
     token.type = type;
-    token.line = scanner.line;
-    token.start = scanner.start;
-    token.length = (int) (scanner.current - scanner.start);
+    token.line = scanner->line;
+    token.start = scanner->start;
+    token.length = (int) (scanner->current - scanner->start);
 
     return token;
 }
 
-Token errorToken(const char* message) {
+static Token errorToken(Scanner* scanner, const char* message) {
     Token token;
     token.type = TOKEN_ERROR;
     token.start = message;
     token.length = (int)strlen(message);
-    token.line = scanner.line;
+    token.line = scanner->line;
 
     return token;
 }
 
-static char advance() {
-    scanner.current++;
-    return scanner.current[-1];
+static char advance(Scanner* scanner) {
+    scanner->current++;
+    return scanner->current[-1];
 }
 
-static bool match(char expected) {
-    if (isAtEnd()) return false;
-    if (*scanner.current != expected) return false;
+static bool match(Scanner* scanner, char expected) {
+    if (isAtEnd(scanner)) return false;
+    if (*scanner->current != expected) return false;
 
-    scanner.current++;
+    scanner->current++;
     return true;
 }
 
-static char peek() {
-    return *scanner.current;
+static char peek(Scanner* scanner) {
+    return *scanner->current;
+}
+
+static char peekNext(Scanner* scanner) {
+    if (isAtEnd(scanner)) return '\0';
+    return scanner->current[1];
+}
+
+// Identifiers and numbers are mostly short, so the vector loops only start after this many chars
+#define SHORT_RUN 8
+
+#ifdef __SSE2__
+// The fast paths classify 16 bytes per step. A load never crosses a page boundary, so reading
+// past the terminating '\0' cannot fault, and '\0' ends every run so those bytes are ignored.
+// Near a page boundary they return early and the scalar loops finish the token.
+
+static bool canLoad(const char* p) {
+    return ((uintptr_t) p & 4095) <= 4096 - 16;
+}
+
+static __m128i load(const char* p) {
+    return _mm_loadu_si128((const __m128i*) p);
+}
+
+static int equalMask(__m128i chunk, char c) {
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, _mm_set1_epi8(c)));
+}
+
+static int rangeMask(__m128i chunk, char low, char high) {
+    // Signed compares are fine, bytes above 127 are never part of a run
+    __m128i above = _mm_cmpgt_epi8(chunk, _mm_set1_epi8((char) (low - 1)));
+    __m128i below = _mm_cmplt_epi8(chunk, _mm_set1_epi8((char) (high + 1)));
+    return _mm_movemask_epi8(_mm_and_si128(above, below));
+}
+
+static int identifierMask(__m128i chunk) {
+    __m128i lower = _mm_or_si128(chunk, _mm_set1_epi8(0x20));
+    return rangeMask(lower, 'a', 'z') | rangeMask(chunk, '0', '9') | equalMask(chunk, '_');
+}
+
+static int digitMask(__m128i chunk) {
+    return rangeMask(chunk, '0', '9');
+}
+
+static int commentMask(__m128i chunk) {
+    return ~(equalMask(chunk, '\n') | equalMask(chunk, '\0')) & 0xffff;
 }
 
-static char peekNext() {
-    if (isAtEnd()) return '\0';
-    return scanner.current[1];
+static const char* skipRun(const char* p, int (*inRun)(__m128i)) {
+    // Bit 16 stops the count once all 16 bytes belong to the run
+    while (canLoad(p)) {
+        int length = __builtin_ctz(inRun(load(p)) ^ 0x1ffff);
+        p += length;
+        if (length < 16) break;
+    }
+    return p;
 }
 
-static void skipWhitespace() {
+// Kept out of line, inlining it into skipWhitespace() slowed down code without indentation
+__attribute__((noinline)) static void skipBlanks(Scanner* scanner) {
+    while (canLoad(scanner->current)) {
+        __m128i chunk = load(scanner->current);
+        int newlines = equalMask(chunk, '\n');
+        int blanks = newlines | equalMask(chunk, ' ') | equalMask(chunk, '\t') | equalMask(chunk, '\r');
+        int length = __builtin_ctz(blanks ^ 0x1ffff);
+        scanner->line += __builtin_popcount(newlines & ((1 << length) - 1));
+        scanner->current += length;
+        if (length < 16) break;
+    }
+}
+
+static void skipStringBody(Scanner* scanner) {
+    while (canLoad(scanner->current)) {
+        __m128i chunk = load(scanner->current);
+        int length = __builtin_ctz(equalMask(chunk, '"') | equalMask(chunk, '\0') | 0x10000);
+        scanner->line += __builtin_popcount(equalMask(chunk, '\n') & ((1 << length) - 1));
+        scanner->current += length;
+        if (length < 16) break;
+    }
+}
+#endif
+
+static void skipWhitespace(Scanner* scanner) {
     for (;;) {
-        char c = peek();
+        char c = peek(scanner);
         switch (c) {
             case ' ':
             case '\r':
             case '\t':
-                advance();
+                advance(scanner);
                 break;
             case '\n':
-                scanner.line++;
-                advance();
+                scanner->line++;
+                advance(scanner);
+#ifdef __SSE2__
+                // Indentation is the only long whitespace run worth the vector loop. Each read
+                // happens only after a space, so none go past the '\0'
+                if (__builtin_expect(peek(scanner) == ' ' && scanner->current[1] == ' ' &&
+                    scanner->current[2] == ' ' && scanner->current[3] == ' ', 0)) skipBlanks(scanner);
+#endif
                 break;
             case '/':
-                if (peekNext() == '/') {
-                    while (peek() != '\n' && !isAtEnd()) advance();
+                if (peekNext(scanner) == '/') {
+#ifdef __SSE2__
+                    scanner->current = skipRun(scanner->current, commentMask);
+#endif
+                    while (peek(scanner) != '\n' && !isAtEnd(scanner)) advance(scanner);
                 } else {
                     return;
                 }
@@ -91,16 +185,19 @@ static void skipWhitespace() {
     }
 }
 
-Token string() {
-    while (peek() != '"' && !isAtEnd()) {
-        if (peek() == '\n') scanner.line++;
-        advance();
+static Token string(Scanner* scanner) {
+#ifdef __SSE2__
+    skipStringBody(scanner);
+#endif
+    while (peek(scanner) != '"' && !isAtEnd(scanner)) {
+        if (peek(scanner) == '\n') scanner->line++;
+        advance(scanner);
     }
 
-    if (isAtEnd()) return errorToken("Unterminated string");
+    if (isAtEnd(scanner)) return errorToken(scanner, "Unterminated string");
 
-    advance();
-    return makeToken(TOKEN_STRING);
+    advance(scanner);
+    return makeToken(scanner, TOKEN_STRING);
 }
 
 static bool isDigit(char c) {
@@ -115,122 +212,140 @@ static bool isAlpha(char c) {
 
 }
 
-static Token number() {
-    while (isDigit(peek())) advance();
-
-    if (peek() == '.' && isDigit(peekNext())) {
-        advance();
-        while (isDigit(peek())) advance();
-    }
-
-    return makeToken(TOKEN_NUMBER);
-}
-
-static TokenType checkKeyword(int start, int length, const char* rest, TokenType type) {
-    if (scanner.current - scanner.start == start + length &&
-        memcmp(scanner.start + start, rest, length) == 0) {
-        return type;
+static void skipDigits(Scanner* scanner) {
+    const char* start = scanner->current;
+    while (isDigit(peek(scanner))) {
+        advance(scanner);
+#ifdef __SSE2__
+        if (scanner->current - start == SHORT_RUN) scanner->current = skipRun(scanner->current, digitMask);
+#endif
     }
-    return TOKEN_IDENTIFIER;
 }
 
-static TokenType identifierType() {
-    switch (scanner.start[0]) {
-        case 'a': return checkKeyword(1, 2, "nd", TOKEN_AND);
-        case 'b': return checkKeyword(1, 4, "reak", TOKEN_BREAK);
-
-        case 'c': if (scanner.current - scanner.start > 1) {
-            switch (scanner.start[1]) {
-                case 'l': return checkKeyword(2, 3, "ass", TOKEN_CLASS);
-                case 'o': return checkKeyword(2, 6, "ntinue", TOKEN_CONTINUE);
-            }
-        }
-        break;
-
-        case 'd': return checkKeyword(1, 2, "ef", TOKEN_DEF);
-        case 'e': return checkKeyword(1, 3, "lse", TOKEN_ELSE);
+static Token number(Scanner* scanner) {
+    skipDigits(scanner);
 
-        case 'f': if (scanner.current - scanner.start > 1) {
-            switch (scanner.start[1]) {
-                case 'a': return checkKeyword(2, 3, "lse", TOKEN_FALSE);
-                case 'o': return checkKeyword(2, 1, "r", TOKEN_FOR);
-                case 'u': return checkKeyword(2, 1, "n", TOKEN_FUN);
-            }
-        }
-        break;
-
-        case 'i': return checkKeyword(1, 1, "f", TOKEN_IF);
-        case 'n': return checkKeyword(1, 2, "il", TOKEN_NIL);
-        case 'o': return checkKeyword(1, 1, "r", TOKEN_OR);
-        case 'p': return checkKeyword(1, 4, "rint", TOKEN_PRINT);
-        case 'r': return checkKeyword(1, 5, "eturn", TOKEN_RETURN);
-        case 's': return checkKeyword(1, 4, "uper", TOKEN_SUPER);
-
-        case 't': if (scanner.current - scanner.start > 1) {
-            switch (scanner.start[1]) {
-                case 'h': return checkKeyword(2, 2, "is", TOKEN_THIS);
-                case 'r': return checkKeyword(2, 2, "ue", TOKEN_TRUE);
-            }
-        }
-        break;
+    if (peek(scanner) == '.' && isDigit(peekNext(scanner))) {
+        advance(scanner);
+        skipDigits(scanner);
+    }
 
-        case 'v': return checkKeyword(1, 2, "ar", TOKEN_VAR);
-        case 'w': return checkKeyword(1, 4, "hile", TOKEN_WHILE);
+    return makeToken(scanner, TOKEN_NUMBER);
+}
 
+typedef struct {
+    const char* name;
+    uint32_t key;
+    TokenType type;
+} Keyword;
+
+// Keys pack the first char, last char and length, which already tells most identifiers apart
+#define KEYWORD_KEY(first, last, length) ((uint32_t) (uint8_t) (first) | (uint32_t) (uint8_t) (last) << 8 | \
+    (uint32_t) (length) << 16)
+#define KEYWORD(name, type) {name, KEYWORD_KEY(name[0], name[sizeof(name) - 2], sizeof(name) - 1), type}
+
+// Perfect hash, key * KEYWORD_MULTIPLIER >> KEYWORD_SHIFT gives every keyword its own slot.
+// The multiplier came from an offline search over odd constants, adding a keyword means
+// searching for a new one.
+#define KEYWORD_MULTIPLIER 0x27540115u
+#define KEYWORD_SHIFT 27
+
+static const Keyword keywords[1 << (32 - KEYWORD_SHIFT)] = {
+    [2] = KEYWORD("for", TOKEN_FOR),
+    [3] = KEYWORD("super", TOKEN_SUPER),
+    [6] = KEYWORD("break", TOKEN_BREAK),
+    [7] = KEYWORD("import", TOKEN_IMPORT),
+    [9] = KEYWORD("print", TOKEN_PRINT),
+    [11] = KEYWORD("nil", TOKEN_NIL),
+    [12] = KEYWORD("continue", TOKEN_CONTINUE),
+    [14] = KEYWORD("while", TOKEN_WHILE),
+    [15] = KEYWORD("or", TOKEN_OR),
+    [17] = KEYWORD("var", TOKEN_VAR),
+    [18] = KEYWORD("this", TOKEN_THIS),
+    [19] = KEYWORD("if", TOKEN_IF),
+    [20] = KEYWORD("return", TOKEN_RETURN),
+    [21] = KEYWORD("else", TOKEN_ELSE),
+    [23] = KEYWORD("and", TOKEN_AND),
+    [24] = KEYWORD("fun", TOKEN_FUN),
+    [26] = KEYWORD("false", TOKEN_FALSE),
+    [27] = KEYWORD("def", TOKEN_DEF),
+    [30] = KEYWORD("class", TOKEN_CLASS),
+    [31] = KEYWORD("true", TOKEN_TRUE),
+};
+
+static TokenType identifierType(Scanner* scanner) {
+    int length = (int) (scanner->current - scanner->start);
+    if (length < 2 || length > 8) return TOKEN_IDENTIFIER;
+
+    uint32_t key = KEYWORD_KEY(scanner->start[0], scanner->start[length - 1], length);
+    const Keyword* keyword = &keywords[(key * KEYWORD_MULTIPLIER) >> KEYWORD_SHIFT];
+    if (keyword->key != key) return TOKEN_IDENTIFIER;
+
+    // The ends already match, only the middle is left to compare
+    for (int i = 1; i < length - 1; i++) {
+        if (scanner->start[i] != keyword->name[i]) return TOKEN_IDENTIFIER;
     }
-
-    return TOKEN_IDENTIFIER;
+    return keyword->type;
 }
 
-static Token identifier() {
-    while (isDigit(peek()) || isAlpha(peek())) advance();
-    return makeToken(identifierType());
+static Token identifier(Scanner* scanner) {
+    while (isDigit(peek(scanner)) || isAlpha(peek(scanner))) {
+        advance(scanner);
+#ifdef __SSE2__
+        if (scanner->current - scanner->start == SHORT_RUN) scanner->current = skipRun(scanner->current, identifierMask);
+#endif
+    }
+    return makeToken(scanner, identifierType(scanner));
 }
 
-Token scanToken() {
-    skipWhitespace();
+static Token nextToken(Scanner* scanner) {
+    skipWhitespace(scanner);
 
-    scanner.start = scanner.current;
+    scanner->start = scanner->current;
 
-    if (isAtEnd()) return makeToken(TOKEN_EOF);
+    if (isAtEnd(scanner)) return makeToken(scanner, TOKEN_EOF);
 
-    char c = advance();
-    if (isAlpha(c)) return identifier();
-    if (isDigit(c)) return number();
+    char c = advance(scanner);
+    if (isAlpha(c)) return identifier(scanner);
+    if (isDigit(c)) return number(scanner);
 
     switch (c) {
-        case '(': return makeToken(TOKEN_LEFT_PAREN);
-        case ')': return makeToken(TOKEN_RIGHT_PAREN);
-        case '{': return makeToken(TOKEN_LEFT_BRACE);
-        case '}': return makeToken(TOKEN_RIGHT_BRACE);
-        case ';': return makeToken(TOKEN_SEMICOLON);
-        case ',': return makeToken(TOKEN_COMMA);
-        case '.': return makeToken(TOKEN_DOT);
-        case '/': return makeToken(TOKEN_SLASH);
-        case '*': return makeToken(TOKEN_STAR);
-        case '?': return makeToken(TOKEN_QUESTION_MARK);
-        case ':': return makeToken(TOKEN_COLON);
-        case '[': return makeToken(TOKEN_LEFT_SQUARE);
-        case ']': return makeToken(TOKEN_RIGHT_SQUARE);
+        case '(': return makeToken(scanner, TOKEN_LEFT_PAREN);
+        case ')': return makeToken(scanner, TOKEN_RIGHT_PAREN);
+        case '{': return makeToken(scanner, TOKEN_LEFT_BRACE);
+        case '}': return makeToken(scanner, TOKEN_RIGHT_BRACE);
+        case ';': return makeToken(scanner, TOKEN_SEMICOLON);
+        case ',': return makeToken(scanner, TOKEN_COMMA);
+        case '.': return makeToken(scanner, TOKEN_DOT);
+        case '/': return makeToken(scanner, TOKEN_SLASH);
+        case '*': return makeToken(scanner, TOKEN_STAR);
+        case '?': return makeToken(scanner, TOKEN_QUESTION_MARK);
+        case ':': return makeToken(scanner, TOKEN_COLON);
+        case '[': return makeToken(scanner, TOKEN_LEFT_SQUARE);
+        case ']': return makeToken(scanner, TOKEN_RIGHT_SQUARE);
         case '=':
-            return makeToken(match('=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
+            return makeToken(scanner, match(scanner, '=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
         case '!':
-            return makeToken(match('=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
+            return makeToken(scanner, match(scanner, '=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
         case '<':
-            if (match('=')) return makeToken(TOKEN_LESS_EQUAL);
-            if (match('<')) return makeToken(TOKEN_LESS_LESS);
-            return makeToken(TOKEN_LESS);
+            if (match(scanner, '=')) return makeToken(scanner, TOKEN_LESS_EQUAL);
+            if (match(scanner, '<')) return makeToken(scanner, TOKEN_LESS_LESS);
+            return makeToken(scanner, TOKEN_LESS);
         case '>':
-            return makeToken(match('=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
+            return makeToken(scanner, match(scanner, '=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
         case '+':
-            return makeToken(match('+') ? TOKEN_PLUS_PLUS : TOKEN_PLUS);
+            return makeToken(scanner, match(scanner, '+') ? TOKEN_PLUS_PLUS : TOKEN_PLUS);
         case '-':
-            if (match('-')) return makeToken(TOKEN_MINUS_MINUS);
-            if (match('>')) return makeToken(TOKEN_ARROW);
-            return makeToken(TOKEN_MINUS);
-        case '"': return string();
+            if (match(scanner, '-')) return makeToken(scanner, TOKEN_MINUS_MINUS);
+            if (match(scanner, '>')) return makeToken(scanner, TOKEN_ARROW);
+            return makeToken(scanner, TOKEN_MINUS);
+        case '"': return string(scanner);
 
     }
 
-    return errorToken("Unexpected character");
+    return errorToken(scanner, "Unexpected character");
+}
+
+Token scanToken() {
+    return nextToken(&threadScanner);
 }
\ No newline at end of file
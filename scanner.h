@@ -30,6 +30,7 @@ typedef enum {
     // Custom.
     TOKEN_QUESTION_MARK, TOKEN_COLON,
     TOKEN_BREAK, TOKEN_CONTINUE,
+    TOKEN_IMPORT,
 
     // Assignment.
     TOKEN_PLUS_PLUS, TOKEN_MINUS_MINUS,
@@ -55,6 +56,7 @@ typedef struct {
 } Token;
 
 void initScanner(const char* source);
+void initScannerAt(const char* source, int line);
 Token scanToken();
 
 #endif
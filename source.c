@@ -0,0 +1,95 @@
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "source.h"
+
+#define READ_CHUNK_SIZE (64 * 1024)
+
+static bool mapSource(int descriptor, size_t length, Source* source) {
+    // Reserve one zeroed page more than the file needs and map the file over the start of
+    // it. The scanner then finds a '\0' right after the last char even when the file fills
+    // its final page exactly, and nothing is copied
+    size_t pageSize = (size_t) sysconf(_SC_PAGESIZE);
+    size_t mappedSize = (length / pageSize + 1) * pageSize;
+    char* region = mmap(NULL, mappedSize, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED) return false;
+
+    if (mmap(region, length, PROT_READ, MAP_PRIVATE | MAP_FIXED, descriptor, 0) == MAP_FAILED) {
+        munmap(region, mappedSize);
+        return false;
+    }
+    madvise(region, length, MADV_SEQUENTIAL);
+
+    source->chars = region;
+    source->length = length;
+    source->mappedSize = mappedSize;
+    return true;
+}
+
+static bool streamSource(int descriptor, size_t sizeHint, Source* source) {
+    // Pipes and terminals have no size up front, so read straight into a growing buffer
+    // rather than through stdio's own buffer
+    size_t capacity = sizeHint + 1 > READ_CHUNK_SIZE ? sizeHint + 1 : READ_CHUNK_SIZE;
+    size_t length = 0;
+    char* chars = malloc(capacity);
+    if (chars == NULL) return false;
+
+    for (;;) {
+        if (capacity - length < READ_CHUNK_SIZE / 2) {
+            capacity *= 2;
+            char* grown = realloc(chars, capacity);
+            if (grown == NULL) {
+                free(chars);
+                return false;
+            }
+            chars = grown;
+        }
+
+        ssize_t bytesRead = read(descriptor, chars + length, capacity - length - 1);
+        if (bytesRead == 0) break;
+        if (bytesRead < 0) {
+            free(chars);
+            return false;
+        }
+        length += (size_t) bytesRead;
+    }
+    chars[length] = '\0';
+
+    source->chars = chars;
+    source->length = length;
+    source->mappedSize = 0;
+    return true;
+}
+
+bool openSource(const char* path, Source* source) {
+    // "-" reads the script from standard input
+    bool isStandardInput = strcmp(path, "-") == 0;
+    int descriptor = isStandardInput ? STDIN_FILENO : open(path, O_RDONLY);
+    if (descriptor < 0) return false;
+
+    struct stat status;
+    bool opened = false;
+    if (fstat(descriptor, &status) == 0) {
+        bool isRegular = S_ISREG(status.st_mode);
+        if (isRegular && status.st_size > 0) opened = mapSource(descriptor, (size_t) status.st_size, source);
+        if (!opened) opened = streamSource(descriptor, isRegular ? (size_t) status.st_size : 0, source);
+    }
+
+    if (!isStandardInput) close(descriptor);
+    return opened;
+}
+
+void closeSource(Source* source) {
+    if (source->mappedSize != 0) {
+        munmap((void*) source->chars, source->mappedSize);
+    } else {
+        free((void*) source->chars);
+    }
+    source->chars = NULL;
+    source->length = 0;
+    source->mappedSize = 0;
+}
@@ -0,0 +1,20 @@
+//
+// Created by Yuriy Kulinchenko on 18/10/2026.
+//
+
+#ifndef clox_source_h
+#define clox_source_h
+
+#include "common.h"
+
+// A whole script in memory, always followed by a '\0' for the scanner
+typedef struct {
+    const char* chars;
+    size_t length;
+    size_t mappedSize; // 0 when chars was read into a heap buffer instead
+} Source;
+
+bool openSource(const char* path, Source* source);
+void closeSource(Source* source);
+
+#endif
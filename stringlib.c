@@ -0,0 +1,234 @@
+#include <ctype.h>
+#include <math.h>
+#include <string.h>
+
+#include "stringlib.h"
+#include "memory.h"
+#include "vm.h"
+
+typedef bool (*StringMethod)(ObjString* string, int argumentCount, Value* arguments, Value* result);
+
+typedef struct {
+    const char* name;
+    int minArity;
+    int maxArity;
+    StringMethod method;
+} StringMethodEntry;
+
+static bool isIndex(Value value) {
+    return IS_NUMBER(value) && AS_NUMBER(value) == floor(AS_NUMBER(value));
+}
+
+static bool stringArgument(Value value, const char* method, ObjString** string) {
+    if (!IS_STRING(value)) {
+        runtimeError("Argument of %s must be a string", method);
+        return false;
+    }
+    *string = AS_STRING(value);
+    return true;
+}
+
+static int findSubstring(const char* haystack, int length, const char* needle, int needleLength, int from) {
+    // memchr skips to each candidate first byte, only those are compared in full
+    if (needleLength == 0) return from <= length ? from : -1;
+    const char* end = haystack + length - needleLength + 1;
+    const char* cursor = haystack + from;
+    while (cursor < end) {
+        cursor = memchr(cursor, needle[0], end - cursor);
+        if (cursor == NULL) return -1;
+        if (memcmp(cursor + 1, needle + 1, needleLength - 1) == 0) return (int) (cursor - haystack);
+        cursor++;
+    }
+    return -1;
+}
+
+static bool substrMethod(ObjString* string, int argumentCount, Value* arguments, Value* result) {
+    // substr(start, length), the length is clamped to the end of the string
+    if (!isIndex(arguments[0]) || AS_NUMBER(arguments[0]) < 0 || AS_NUMBER(arguments[0]) > string->length) {
+        runtimeError("Start of substr must be an index into the string");
+        return false;
+    }
+    int start = (int) AS_NUMBER(arguments[0]);
+    int length = string->length - start;
+    if (argumentCount == 2) {
+        if (!isIndex(arguments[1]) || AS_NUMBER(arguments[1]) < 0) {
+            runtimeError("Length of substr must be a non-negative integer");
+            return false;
+        }
+        if (AS_NUMBER(arguments[1]) < length) length = (int) AS_NUMBER(arguments[1]);
+    }
+    if (start == 0 && length == string->length) {
+        *result = OBJ_VAL(string);
+        return true;
+    }
+    *result = OBJ_VAL(newSlice(string, start, length));
+    return true;
+}
+
+static bool indexOfMethod(ObjString* string, int argumentCount, Value* arguments, Value* result) {
+    ObjString* needle;
+    if (!stringArgument(arguments[0], "indexOf", &needle)) return false;
+    int from = 0;
+    if (argumentCount == 2) {
+        if (!isIndex(arguments[1]) || AS_NUMBER(arguments[1]) < 0) {
+            runtimeError("Start of indexOf must be a non-negative integer");
+            return false;
+        }
+        from = AS_NUMBER(arguments[1]) > string->length ? string->length : (int) AS_NUMBER(arguments[1]);
+    }
+    char* chars = stringChars(string);
+    char* needleChars = stringChars(needle);
+    *result = NUMBER_VAL(findSubstring(chars, string->length, needleChars, needle->length, from));
+    return true;
+}
+
+static bool startsWithMethod(ObjString* string, int argumentCount, Value* arguments, Value* result) {
+    ObjString* prefix;
+    if (!stringArgument(arguments[0], "startsWith", &prefix)) return false;
+    *result = BOOL_VAL(prefix->length <= string->length &&
+        memcmp(stringChars(string), stringChars(prefix), prefix->length) == 0);
+    return true;
+}
+
+static bool endsWithMethod(ObjString* string, int argumentCount, Value* arguments, Value* result) {
+    ObjString* suffix;
+    if (!stringArgument(arguments[0], "endsWith", &suffix)) return false;
+    *result = BOOL_VAL(suffix->length <= string->length &&
+        memcmp(stringChars(string) + string->length - suffix->length, stringChars(suffix), suffix->length) == 0);
+    return true;
+}
+
+static bool splitMethod(ObjString* string, int argumentCount, Value* arguments, Value* result) {
+    // Each piece is a slice of the receiver, only the array and the headers are allocated
+    ObjString* separator;
+    if (!stringArgument(arguments[0], "split", &separator)) return false;
+    if (separator->length == 0) {
+        runtimeError("Separator of split cannot be empty");
+        return false;
+    }
+    char* separatorChars = stringChars(separator);
+    char* chars = stringChars(string);
+
+    ObjArray* array = newArray(NULL, 0);
+    push(OBJ_VAL(array));
+    int start = 0;
+    while (true) {
+        int end = findSubstring(chars, string->length, separatorChars, separator->length, start);
+        int pieceEnd = end == -1 ? string->length : end;
+        // The piece is on the stack while the array grows to take it
+        push(OBJ_VAL(newSlice(string, start, pieceEnd - start)));
+        writeValueArray(&array->valueArray, vm.stackTop[-1]);
+        pop();
+        if (end == -1) break;
+        start = end + separator->length;
+    }
+    pop();
+    *result = OBJ_VAL(array);
+    return true;
+}
+
+static bool replaceMethod(ObjString* string, int argumentCount, Value* arguments, Value* result) {
+    // Replaces every occurrence. They are counted first so the result is allocated once
+    ObjString* old;
+    ObjString* replacement;
+    if (!stringArgument(arguments[0], "replace", &old)) return false;
+    if (!stringArgument(arguments[1], "replace", &replacement)) return false;
+    if (old->length == 0) {
+        runtimeError("String to replace cannot be empty");
+        return false;
+    }
+    char* chars = stringChars(string);
+    char* oldChars = stringChars(old);
+    char* replacementChars = stringChars(replacement);
+
+    int matches = 0;
+    for (int i = findSubstring(chars, string->length, oldChars, old->length, 0); i != -1;
+         i = findSubstring(chars, string->length, oldChars, old->length, i + old->length)) {
+        matches++;
+    }
+    if (matches == 0) {
+        *result = OBJ_VAL(string);
+        return true;
+    }
+
+    int64_t length = string->length + (int64_t) matches * (replacement->length - old->length);
+    if (length > STRING_MAX_LENGTH) {
+        runtimeError("Result of replace is too long");
+        return false;
+    }
+    ObjString* replaced = newDataString((int) length);
+    // Slices keep pointing into their parent, which does not move when the result is allocated
+    char* destination = replaced->chars;
+    int start = 0;
+    for (int i = findSubstring(chars, string->length, oldChars, old->length, 0); i != -1;
+         i = findSubstring(chars, string->length, oldChars, old->length, start)) {
+        memcpy(destination, chars + start, i - start);
+        destination += i - start;
+        memcpy(destination, replacementChars, replacement->length);
+        destination += replacement->length;
+        start = i + old->length;
+    }
+    memcpy(destination, chars + start, string->length - start);
+    *result = OBJ_VAL(replaced);
+    return true;
+}
+
+static bool convertCase(ObjString* string, int (*convert)(int), Value* result) {
+    char* chars = stringChars(string);
+    ObjString* converted = newDataString(string->length);
+    for (int i = 0; i < string->length; i++) {
+        converted->chars[i] = (char) convert((unsigned char) chars[i]);
+    }
+    *result = OBJ_VAL(converted);
+    return true;
+}
+
+static bool upperMethod(ObjString* string, int argumentCount, Value* arguments, Value* result) {
+    return convertCase(string, toupper, result);
+}
+
+static bool lowerMethod(ObjString* string, int argumentCount, Value* arguments, Value* result) {
+    return convertCase(string, tolower, result);
+}
+
+static const StringMethodEntry stringMethods[] = {
+    {"substr", 1, 2, substrMethod},
+    {"indexOf", 1, 2, indexOfMethod},
+    {"startsWith", 1, 1, startsWithMethod},
+    {"endsWith", 1, 1, endsWithMethod},
+    {"split", 1, 1, splitMethod},
+    {"replace", 2, 2, replaceMethod},
+    {"upper", 0, 0, upperMethod},
+    {"lower", 0, 0, lowerMethod},
+};
+
+void initStringMethods() {
+    // The table maps each interned name to its entry, so invoking is one pointer keyed lookup
+    for (int i = 0; i < (int) (sizeof(stringMethods) / sizeof(stringMethods[0])); i++) {
+        ObjString* name = copyString((char*) stringMethods[i].name, (int) strlen(stringMethods[i].name));
+        push(OBJ_VAL(name));
+        tableSet(&vm.stringMethods, name, NUMBER_VAL(i));
+        pop();
+    }
+}
+
+bool invokeStringMethod(ObjString* name, int argumentCount) {
+    Value index;
+    if (!tableGet(&vm.stringMethods, name, &index)) {
+        runtimeError("String does not have method %s", name->chars);
+        return false;
+    }
+    const StringMethodEntry* entry = &stringMethods[(int) AS_NUMBER(index)];
+    if (argumentCount < entry->minArity || argumentCount > entry->maxArity) {
+        runtimeError("Incorrect number of arguments passed into %s", entry->name);
+        return false;
+    }
+
+    // The receiver and arguments stay on the stack while the method allocates
+    Value* arguments = vm.stackTop - argumentCount;
+    Value result;
+    if (!entry->method(AS_STRING(arguments[-1]), argumentCount, arguments, &result)) return false;
+    vm.stackTop = arguments;
+    vm.stackTop[-1] = result;
+    return true;
+}
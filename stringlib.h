@@ -0,0 +1,15 @@
+//
+// Created by Yuriy Kulinchenko on 18/10/2026.
+//
+
+#ifndef clox_stringlib_h
+#define clox_stringlib_h
+
+#include "common.h"
+#include "object.h"
+
+void initStringMethods();
+// The receiver and arguments are on the stack, the result replaces the receiver
+bool invokeStringMethod(ObjString* name, int argumentCount);
+
+#endif
@@ -8,109 +8,273 @@
 
 #include "value.h"
 
-#define TABLE_MAX_LOAD 0.75
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 // #define TABLE_DEBUG
 
+#define GROUP_SIZE 16
+// A full group is probed past, so a lookup only ends on a group with an empty slot.
+// The load limit guarantees there always is one
+#define TABLE_MAX_LOAD(capacity) ((capacity) - (capacity) / 8)
+
+// Control bytes. A full slot holds the low 7 bits of its key's hash, so its top bit is clear
+#define CONTROL_EMPTY 0x80
+#define CONTROL_DELETED 0xfe
+#define IS_FULL(control) ((control) < 0x80)
+
+#define HASH_TAG(hash) ((uint8_t) ((hash) & 0x7f))
+#define HASH_GROUP(hash) ((hash) >> 7)
+
+// One bit per slot of a group, bit i for slot i
+typedef uint32_t GroupMask;
+
+#ifdef __SSE2__
+static inline GroupMask matchTag(const uint8_t* group, uint8_t tag) {
+    __m128i bytes = _mm_loadu_si128((const __m128i*) group);
+    return (GroupMask) _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8((char) tag)));
+}
+
+static inline GroupMask matchEmpty(const uint8_t* group) {
+    return matchTag(group, CONTROL_EMPTY);
+}
+
+static inline GroupMask matchFree(const uint8_t* group) {
+    // Empty and deleted are the only control bytes with the top bit set
+    return (GroupMask) _mm_movemask_epi8(_mm_loadu_si128((const __m128i*) group));
+}
+#else
+static inline GroupMask matchTag(const uint8_t* group, uint8_t tag) {
+    GroupMask mask = 0;
+    for (int i = 0; i < GROUP_SIZE; i++) {
+        if (group[i] == tag) mask |= 1u << i;
+    }
+    return mask;
+}
+
+static inline GroupMask matchEmpty(const uint8_t* group) {
+    return matchTag(group, CONTROL_EMPTY);
+}
+
+static inline GroupMask matchFree(const uint8_t* group) {
+    GroupMask mask = 0;
+    for (int i = 0; i < GROUP_SIZE; i++) {
+        if (!IS_FULL(group[i])) mask |= 1u << i;
+    }
+    return mask;
+}
+#endif
+
+static inline Entry* tableEntries(Table* table) {
+    // The control bytes come first, a whole number of groups keeps the entries aligned
+    return (Entry*) (table->control + table->capacity);
+}
+
+static size_t tableBytes(int capacity) {
+    return (size_t) capacity * (1 + sizeof(Entry));
+}
+
+static inline bool isInline(Table* table) {
+    return table->capacity == 0;
+}
+
+// Live entries are visited by slot, inline tables have exactly count of them
+static inline int slotCount(Table* table) {
+    return isInline(table) ? table->count : table->capacity;
+}
+
+static inline Entry* liveEntry(Table* table, int slot) {
+    if (isInline(table)) return &table->inlineEntries[slot];
+    return IS_FULL(table->control[slot]) ? &tableEntries(table)[slot] : NULL;
+}
+
 void initTable(Table* table) {
     table->count = 0;
+    table->tombstones = 0;
     table->capacity = 0;
-    table->entries = NULL;
+    table->control = NULL;
 }
 
 void freeTable(Table* table) {
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+    FREE_ARRAY(uint8_t, table->control, tableBytes(table->capacity));
     initTable(table);
 }
 
-Entry* findEntry(Entry* entries, int capacity, ObjString* key) {
-    // Returns entry pointer with key "key"
-    // If this is not present, returns first empty slot
-    // If any tombstones are encountered on the way, the tombstone is returned
-    Entry* tombstone = NULL;
-    uint32_t index =  key->hash & capacity - 1;
-    for (;;) {
-        Entry* entry = &entries[index];
-
-        if (entry->key == NULL) {
-            if (AS_BOOL(entry->value)) {
-                tombstone = entry;
-            } else {
-                if (tombstone != NULL) return tombstone;
-                return entry;
-            }
-        }
-
-        if (entry->key == key) return entry;
+// Probing visits groups 1, 2, 3... apart, which reaches every group of a power of two
+// table before repeating
+static inline size_t groupMask(Table* table) {
+    return (size_t) table->capacity / GROUP_SIZE - 1;
+}
 
-        index = index + 1 & capacity - 1;
+static inline int findIndex(Table* table, ObjString* key) {
+    // Slot holding key, or -1
+    Entry* entries = tableEntries(table);
+    uint8_t tag = HASH_TAG(key->hash);
+    size_t mask = groupMask(table);
+    size_t group = HASH_GROUP(key->hash) & mask;
+    for (size_t step = 1;; step++) {
+        const uint8_t* control = table->control + group * GROUP_SIZE;
+        for (GroupMask matches = matchTag(control, tag); matches != 0; matches &= matches - 1) {
+            int index = (int) (group * GROUP_SIZE) + __builtin_ctz(matches);
+            if (entries[index].key == key) return index;
+        }
+        if (matchEmpty(control) != 0) return -1;
+        group = (group + step) & mask;
     }
 }
 
-void adjustCapacity(Table* table, int capacity) {
-    Entry* entries = ALLOCATE(Entry, capacity);
-    for (int i = 0; i < capacity; i++) {
-        entries[i].key = NULL;
-        entries[i].value = BOOL_VAL(false);
+static int findFreeIndex(Table* table, uint32_t hash) {
+    // First empty or deleted slot on the probe sequence of hash
+    size_t mask = groupMask(table);
+    size_t group = HASH_GROUP(hash) & mask;
+    for (size_t step = 1;; step++) {
+        GroupMask free = matchFree(table->control + group * GROUP_SIZE);
+        if (free != 0) return (int) (group * GROUP_SIZE) + __builtin_ctz(free);
+        group = (group + step) & mask;
     }
+}
 
-    // Now, hashes must be recomputed, entries put in etc
+static void adjustCapacity(Table* table, int capacity) {
+    Table resized;
+    resized.count = 0;
+    resized.tombstones = 0;
+    resized.capacity = capacity;
+    resized.control = ALLOCATE(uint8_t, tableBytes(capacity));
+    memset(resized.control, CONTROL_EMPTY, capacity);
 
-    int count = 0;
-    for (int i = 0; i < table->capacity; i++) {
-        Entry* entry = &table->entries[i];
-        if (entry->key == NULL) continue; // Skips tombstones as well
+    // Every key is known to be absent, so it goes straight into the first free slot
+    Entry* resizedEntries = tableEntries(&resized);
+    for (int i = 0; i < slotCount(table); i++) {
+        Entry* entry = liveEntry(table, i);
+        if (entry == NULL) continue; // Skips tombstones as well
 
-        Entry* position = findEntry(entries, capacity, entry->key);
-        position->key = entry->key;
-        position->value = entry->value;
-        count++;
+        int index = findFreeIndex(&resized, entry->key->hash);
+        resized.control[index] = HASH_TAG(entry->key->hash);
+        resizedEntries[index] = *entry;
+        resized.count++;
     }
 
-    FREE_ARRAY(Entry, table->entries, table->capacity);
-    table->entries = entries;
+    FREE_ARRAY(uint8_t, table->control, tableBytes(table->capacity));
+    table->count = resized.count;
+    table->tombstones = 0;
     table->capacity = capacity;
-    table->count = count;
+    table->control = resized.control;
+}
+
+static inline Entry* findEntry(Table* table, ObjString* key) {
+    if (isInline(table)) {
+        for (int i = 0; i < table->count; i++) {
+            if (table->inlineEntries[i].key == key) return &table->inlineEntries[i];
+        }
+        return NULL;
+    }
+    int index = findIndex(table, key);
+    return index == -1 ? NULL : &tableEntries(table)[index];
 }
 
 bool tableSet(Table* table, ObjString* key, Value value) {
-    if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
-        int capacity = table->capacity < 8 ? 8 : table->capacity * 2;
-        adjustCapacity(table, capacity);
+    Entry* existing = findEntry(table, key);
+    if (existing != NULL) {
+        existing->value = value;
+        return false;
+    }
+
+    if (isInline(table)) {
+        if (table->count < TABLE_INLINE_CAPACITY) {
+            table->inlineEntries[table->count++] = (Entry) {.key = key, .value = value};
+            return true;
+        }
+        adjustCapacity(table, GROUP_SIZE);
+    } else if (table->count + table->tombstones + 1 > TABLE_MAX_LOAD(table->capacity)) {
+        // When tombstones take up much of the load, rehashing at the same size clears them
+        bool crowded = table->count + 1 > TABLE_MAX_LOAD(table->capacity) / 2;
+        adjustCapacity(table, crowded ? table->capacity * 2 : table->capacity);
     }
     // Guaranteed to have space now:
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    bool isNewKey = entry->key == NULL;
-    if (isNewKey && !AS_BOOL(entry->value)) table->count++;
-    entry->key = key;
-    entry->value = value;
-    return isNewKey;
+    int index = findFreeIndex(table, key->hash);
+    if (table->control[index] == CONTROL_DELETED) table->tombstones--;
+    table->control[index] = HASH_TAG(key->hash);
+    tableEntries(table)[index] = (Entry) {.key = key, .value = value};
+    table->count++;
+    return true;
 }
 
 bool tableGet(Table* table, ObjString* key, Value* value) {
     // If the value exists, it is stored in the given pointer location
     // Returns true if value is present, false otherwise
-    if (table->count == 0) return false;
-
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
+    Entry* entry = findEntry(table, key);
+    if (entry == NULL) return false;
 
     if (value != NULL) *value = entry->value;
     return true;
 }
 
 void tableAddAll(Table* from, Table* to) {
-    for (int i = 0; i < from->capacity; i++) {
-        Entry* fromEntry = &from->entries[i];
-        if (fromEntry->key != NULL) tableSet(to, fromEntry->key, fromEntry->value);
+    for (int i = 0; i < slotCount(from); i++) {
+        Entry* entry = liveEntry(from, i);
+        if (entry != NULL) tableSet(to, entry->key, entry->value);
+    }
+}
+
+static void removeIndex(Table* table, int index) {
+    // A group with an empty slot has never been full, so no probe sequence has gone past it
+    // and the slot can simply be emptied. Otherwise it must stay as a tombstone
+    const uint8_t* group = table->control + (index & ~(GROUP_SIZE - 1));
+    if (matchEmpty(group) != 0) {
+        table->control[index] = CONTROL_EMPTY;
+    } else {
+        table->control[index] = CONTROL_DELETED;
+        table->tombstones++;
+    }
+    table->count--;
+}
+
+static void moveInline(Table* table) {
+    Entry entries[TABLE_INLINE_CAPACITY];
+    int count = 0;
+    for (int i = 0; i < table->capacity; i++) {
+        Entry* entry = liveEntry(table, i);
+        if (entry != NULL) entries[count++] = *entry;
+    }
+
+    FREE_ARRAY(uint8_t, table->control, tableBytes(table->capacity));
+    initTable(table);
+    memcpy(table->inlineEntries, entries, sizeof(Entry) * count);
+    table->count = count;
+}
+
+void tableCompact(Table* table) {
+    // Rehashes once tombstones fill a quarter of the slots, which lengthens every probe
+    // past them, or once the live entries fill less than an eighth. The new size leaves
+    // the table at most half full, so it does not grow again straight away, but is never
+    // larger than the old one
+    if (isInline(table)) return;
+    if (table->tombstones <= table->capacity / 4 && table->count >= table->capacity / 8) return;
+
+    if (table->count <= TABLE_INLINE_CAPACITY) {
+        moveInline(table);
+        return;
     }
+    int capacity = GROUP_SIZE;
+    while (capacity < table->capacity && table->count > TABLE_MAX_LOAD(capacity) / 2) capacity *= 2;
+    adjustCapacity(table, capacity);
 }
 
 bool tableDelete(Table* table, ObjString* key) {
     if (table->count == 0) return false;
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
-    entry->key = NULL;
-    entry->value = BOOL_VAL(true); // Tombstone added
+    if (isInline(table)) {
+        // Order does not matter, the last entry fills the gap
+        Entry* entry = findEntry(table, key);
+        if (entry == NULL) return false;
+        *entry = table->inlineEntries[--table->count];
+        return true;
+    }
+
+    int index = findIndex(table, key);
+    if (index == -1) return false;
+    removeIndex(table, index);
+    tableCompact(table);
     return true;
 }
 
@@ -118,26 +282,35 @@ ObjString* tableFindString(Table* table, char* chars, int length, uint32_t hash)
     // Return null if the string is not found
     // previous reference equality check does not work here
     if (table->count == 0) return NULL;
-    uint32_t index = hash % table->capacity;
-    for (;;) {
-        Entry* entry = &table->entries[index];
-        if (entry->key == NULL) {
-            if (!AS_BOOL(entry->value)) return NULL;
-        } else {
-            if (entry->key == NULL && !AS_BOOL(entry->value)) return NULL;
-            if (entry->key->hash == hash && entry->key->length == length &&
-                memcmp(chars, entry->key->chars, length) == 0) return entry->key;
+    if (isInline(table)) {
+        for (int i = 0; i < table->count; i++) {
+            ObjString* key = table->inlineEntries[i].key;
+            if (key->hash == hash && key->length == length && memcmp(chars, key->chars, length) == 0) return key;
+        }
+        return NULL;
+    }
+
+    Entry* entries = tableEntries(table);
+    uint8_t tag = HASH_TAG(hash);
+    size_t mask = groupMask(table);
+    size_t group = HASH_GROUP(hash) & mask;
+    for (size_t step = 1;; step++) {
+        const uint8_t* control = table->control + group * GROUP_SIZE;
+        for (GroupMask matches = matchTag(control, tag); matches != 0; matches &= matches - 1) {
+            ObjString* key = entries[group * GROUP_SIZE + __builtin_ctz(matches)].key;
+            if (key->hash == hash && key->length == length && memcmp(chars, key->chars, length) == 0) return key;
         }
-        index = (index + 1) % table->capacity;
+        if (matchEmpty(control) != 0) return NULL;
+        group = (group + step) & mask;
     }
 }
 
 void printTable(Table* table) {
     printf("{");
     bool isFirst = true;
-    for (int i = 0; i < table->capacity; i++) {
-        Entry* entry = &table->entries[i];
-        if (entry->key == NULL) continue;
+    for (int i = 0; i < slotCount(table); i++) {
+        Entry* entry = liveEntry(table, i);
+        if (entry == NULL) continue;
 
         if (isFirst) {
             isFirst = false;
@@ -154,26 +327,22 @@ void printTable(Table* table) {
     printf("\n");
     printf("===TABLE_DEBUG===\n");
     printf("count: %d, ", table->count);
+    printf("tombstones: %d, ", table->tombstones);
     printf("capacity: %d", table->capacity);
 
     printf("\n[");
     isFirst = true;
     for (int i = 0; i < table->capacity; i++) {
-        Entry* entry = &table->entries[i];
-
         if (isFirst) {
             isFirst = false;
         } else {
             printf(", ");
         }
 
-
-        if (entry->key == NULL) {
-            if (AS_BOOL(entry->value)) {
-                printf("TOMBSTONE");
-            } else {
-                printf("NULL");
-            }
+        if (table->control[i] == CONTROL_DELETED) {
+            printf("TOMBSTONE");
+        } else if (table->control[i] == CONTROL_EMPTY) {
+            printf("NULL");
         } else {
             printf("VALUE");
         }
@@ -184,9 +353,9 @@ void printTable(Table* table) {
 }
 
 void markTable(Table* table) {
-    for (int i = 0; i < table->capacity; i++) {
-        Entry* entry = &table->entries[i];
-        if (entry->key != NULL) {
+    for (int i = 0; i < slotCount(table); i++) {
+        Entry* entry = liveEntry(table, i);
+        if (entry != NULL) {
             markObject((Obj*) entry->key);
             markValue(entry->value);
         }
@@ -194,11 +363,21 @@ void markTable(Table* table) {
 }
 
 void tableRemoveWhite(Table* table) {
-    for (int i = 0; i < table->capacity; i++) {
-        Entry* entry = &table->entries[i];
-        if (entry->key == NULL) break;
-        if (entry->key != NULL && !entry->key->obj.isMarked) {
-            tableDelete(table, entry->key);
+    if (isInline(table)) {
+        // Backwards, so the entry moved into a removed slot has already been checked
+        for (int i = table->count - 1; i >= 0; i--) {
+            if (!table->inlineEntries[i].key->obj.isMarked) {
+                table->inlineEntries[i] = table->inlineEntries[--table->count];
+            }
         }
+        return;
+    }
+
+    // Runs in the middle of a collection, so nothing is reallocated here. The collector
+    // compacts the table once it is done
+    Entry* entries = tableEntries(table);
+    for (int i = 0; i < table->capacity; i++) {
+        if (!IS_FULL(table->control[i])) continue;
+        if (!entries[i].key->obj.isMarked) removeIndex(table, i);
     }
 }
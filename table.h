@@ -14,10 +14,21 @@ typedef struct {
     Value value;
 } Entry;
 
+// Tables up to this size keep their entries inside the Table itself, most classes have a
+// few methods and most instances a few fields
+#define TABLE_INLINE_CAPACITY 4
+
+// Small tables are a plain array searched by key pointer. Larger ones use open addressing
+// in the style of a Swiss table. One control byte per slot holds 7 bits of
+// the key's hash, or marks the slot as empty or deleted, so a probe compares a whole group of
+// slots at once and only touches an entry when its hash bits match. The entries follow the
+// control bytes in the same allocation
 typedef struct {
-    int count;
-    int capacity;
-    Entry* entries;
+    int count; // Live entries
+    int tombstones; // Deleted slots that still continue probe sequences
+    int capacity; // Number of hashed slots, a power of two of at least one group, or zero while inline
+    uint8_t* control;
+    Entry inlineEntries[TABLE_INLINE_CAPACITY]; // The first count are live while capacity is zero
 } Table;
 
 void initTable(Table* table);
@@ -30,6 +41,7 @@ bool tableDelete(Table* table, ObjString* key);
 
 void tableAddAll(Table* from, Table* to);
 void tableRemoveWhite(Table* table);
+void tableCompact(Table* table);
 ObjString* tableFindString(Table* table, char* chars, int length, uint32_t hash);
 
 void printTable(Table* table);
@@ -3,19 +3,26 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <sys/uio.h>
 #include "object.h"
+#include "number.h"
 
-static uint8_t nextPower(uint8_t n) {
-    if (n < 8) return 8;
-    if ((n & n - 1) == 0) return n; // Check if n is a power of 2
-    uint8_t shift = 1;
-    uint8_t old;
-    do {
-        old = n;
-        n |= n >> shift;
-        shift <<= 1;
-    } while (n != old);
-    return n + 1;
+static size_t growCapacity(size_t capacity, size_t needed) {
+    // Doubles from 8 until the needed count fits. Stops the process rather than let the size in
+    // bytes overflow
+    size_t grown = capacity < 8 ? 8 : capacity;
+    while (grown < needed) {
+        if (grown > VALUE_ARRAY_MAX / 2) {
+            if (needed > VALUE_ARRAY_MAX) {
+                fprintf(stderr, "Array too large\n");
+                exit(1);
+            }
+            return VALUE_ARRAY_MAX;
+        }
+        grown *= 2;
+    }
+    return grown;
 }
 
 void initValueArray(ValueArray* array) {
@@ -24,173 +31,232 @@ void initValueArray(ValueArray* array) {
     array->values = NULL;
 }
 
-void initValueArrayCopy(ValueArray* array, Value* values, uint8_t count) {
+void initValueArrayCopy(ValueArray* array, Value* values, size_t count) {
     // values pointer is passed from VM stack
     if (count == 0) {
         initValueArray(array);
         return;
     }
+    // Allocated before the array takes the count, a collection here must see it as empty
+    size_t capacity = growCapacity(0, count);
+    array->values = ALLOCATE(Value, capacity);
     array->count = count;
-    array->capacity = nextPower(count);
-    array->values = ALLOCATE(Value, array->capacity);
-    for (int i = 0; i < count; i++) {
-        array->values[i] = values[i];
-    }
+    array->capacity = capacity;
+    memcpy(array->values, values, sizeof(Value) * count);
 }
 
 
 void writeValueArray(ValueArray* array, Value value) {
     if (array->capacity < array->count + 1) {
-        const uint8_t oldCapacity = array->capacity;
-        array->capacity = oldCapacity < 8 ? 8 : 2 * oldCapacity;
+        size_t oldCapacity = array->capacity;
+        array->capacity = growCapacity(oldCapacity, array->count + 1);
         array->values = GROW_ARRAY(Value, array->values, oldCapacity, array->capacity);
     }
     array->values[array->count++] = value;
 }
 
 
-void freeValueArray(ValueArray* array) {
-    reallocate(array->values, array->capacity, 0);
+void reserveValueArray(ValueArray* array, size_t capacity) {
+    // Grows the storage without changing the count, so a collection here sees the same values
+    if (array->capacity >= capacity) return;
+    array->values = GROW_ARRAY(Value, array->values, array->capacity, capacity);
+    array->capacity = capacity;
 }
 
-char* arrayToString(ObjArray* array) {
-    char* chars = strdup("[");
-    bool isFirst = true;
-    for (int i = 0; i < array->valueArray.count; i++) {
-        if (!isFirst) {
-            char* temp = chars;
-            asprintf(&chars, "%s, ", temp);
-            free(temp);
-        } else {
-            isFirst = false;
-        }
-        char* temp = chars;
-        char* valueString = valueToString(array->valueArray.values[i]);
-        asprintf(&chars, "%s%s", temp, valueString);
-        free(temp);
-        free(valueString);
-    }
+void shrinkValueArray(ValueArray* array) {
+    array->values = GROW_ARRAY(Value, array->values, array->capacity, array->count);
+    array->capacity = array->count;
+}
 
-    char* temp = chars;
-    asprintf(&chars, "%s]", temp);
-    free(temp);
-    return chars;
+void freeValueArray(ValueArray* array) {
+    FREE_ARRAY(Value, array->values, array->capacity);
 }
 
-char* objToString(Obj* object) {
-    char* returnChars;
-    switch (object->type) {
-        case OBJ_STRING: {
-            ObjString* string = (ObjString*) object;
-            char* chars = string->chars;
-            asprintf(&returnChars, "\"%s\"", chars);
-            break;
+void initWriter(Writer* writer, char* buffer, int capacity, FILE* sink) {
+    writer->chars = buffer;
+    writer->length = 0;
+    writer->capacity = capacity;
+    writer->sink = sink;
+    writer->depth = 0;
+}
+
+static void writeOut(Writer* writer, const char* run, int runLength) {
+    // Anything stdio still holds for the same file goes first. Then the buffer and a run too
+    // long to fit in it leave together in one writev()
+    fflush(writer->sink);
+    struct iovec parts[2] = {
+        {writer->chars, writer->length},
+        {(void*) run, runLength},
+    };
+    struct iovec* part = parts;
+    int partCount = runLength > 0 ? 2 : 1;
+    while (partCount > 0) {
+        ssize_t written = writev(fileno(writer->sink), part, partCount);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            break; // The output is lost, as it would be with a failed fwrite()
         }
-        case OBJ_CLOSURE: {
-            const ObjClosure* closure = (ObjClosure*) object;
-            const ObjFunction* function = closure->function;
-            char* chars = function->name == NULL ? "script" : function->name->chars;
-            asprintf(&returnChars, "<%s>", chars);
-            break;
+        while (partCount > 0 && (size_t) written >= part->iov_len) {
+            written -= (ssize_t) part->iov_len;
+            part++;
+            partCount--;
         }
-
-        case OBJ_FUNCTION: {
-            const ObjFunction* function = (ObjFunction*) object;
-            char* chars = function->name == NULL ? "script" : function->name->chars;
-            asprintf(&returnChars, "<raw:%s>", chars);
-            break;
+        if (partCount > 0) {
+            part->iov_base = (char*) part->iov_base + written;
+            part->iov_len -= written;
         }
+    }
+    writer->length = 0;
+}
 
-        case OBJ_BOUND_METHOD: {
-            const ObjBoundMethod* boundMethod = (ObjBoundMethod*) object;
-            char* chars = boundMethod->method->function->name->chars;
-            asprintf(&returnChars, "<bound:%s>", chars);
-            break;
+void flushWriter(Writer* writer) {
+    if (writer->sink == NULL || writer->length == 0) return;
+    writeOut(writer, NULL, 0);
+}
 
-            return objToString((Obj*)boundMethod->method);
+void writeChars(Writer* writer, const char* chars, int length) {
+    if (writer->length + length > writer->capacity) {
+        if (writer->sink != NULL) {
+            // A stream only ever holds one buffer's worth, longer runs go straight through
+            if (length > writer->capacity) {
+                writeOut(writer, chars, length);
+                return;
+            }
+            writeOut(writer, NULL, 0);
+        } else {
+            int capacity = writer->capacity < 64 ? 64 : writer->capacity;
+            while (capacity < writer->length + length) capacity *= 2;
+            char* grown = realloc(writer->chars, capacity);
+            if (grown == NULL) exit(1);
+            writer->chars = grown;
+            writer->capacity = capacity;
         }
+    }
+    memcpy(writer->chars + writer->length, chars, length);
+    writer->length += length;
+}
 
-        case OBJ_ARRAY: {
-            ObjArray* array = (ObjArray*) object;
-            return arrayToString(array);
-        }
+static void writeCString(Writer* writer, const char* chars) {
+    writeChars(writer, chars, (int) strlen(chars));
+}
 
-        case OBJ_UPVALUE: {
-            return strdup("upvalue");
-        }
+static void writeStringChars(Writer* writer, ObjString* string) {
+    // A rope is written leaf by leaf rather than flattened, so formatting never allocates
+    // on the heap and cannot start a collection
+    if (string->chars != NULL) {
+        writeChars(writer, string->chars, string->length);
+        return;
+    }
+    ObjRope* rope = (ObjRope*) string;
+    writeStringChars(writer, rope->left);
+    writeStringChars(writer, rope->right);
+}
 
-        case OBJ_CLASS: {
-            const ObjClass* klass = (ObjClass*) object;
-            asprintf(&returnChars, "{class:%s}", klass->name->chars);
-            break;
-        }
+static void writeName(Writer* writer, const char* prefix, ObjString* name, const char* suffix) {
+    writeCString(writer, prefix);
+    if (name == NULL) {
+        writeCString(writer, "script");
+    } else {
+        writeChars(writer, name->chars, name->length);
+    }
+    writeCString(writer, suffix);
+}
 
-        case OBJ_INSTANCE: {
-            const ObjInstance* instance = (ObjInstance*) object;
-            asprintf(&returnChars, "{%s}", instance->klass->name->chars);
-            break;
+static void writeArray(Writer* writer, ObjArray* array) {
+    // Arrays still being written are on writer->open, so one that contains itself is cut short
+    for (int i = 0; i < writer->depth; i++) {
+        if (writer->open[i] == (Obj*) array) {
+            writeCString(writer, "[...]");
+            return;
         }
+    }
+    if (writer->depth == WRITER_MAX_DEPTH) {
+        writeCString(writer, "[...]");
+        return;
+    }
+    writer->open[writer->depth++] = (Obj*) array;
 
-        default: asprintf(&returnChars, "unrecognized object"); break;
+    writeCString(writer, "[");
+    for (size_t i = 0; i < array->valueArray.count; i++) {
+        if (i > 0) writeCString(writer, ", ");
+        writeValue(writer, array->valueArray.values[i]);
     }
-    return returnChars;
+    writeCString(writer, "]");
+    writer->depth--;
 }
 
-char* valueToString(Value value) {
-    char* chars;
-    switch (value.type) {
-        case VAL_NUMBER: {
-            asprintf(&chars,"%g", AS_NUMBER(value));
-            break;
-        }
-        case VAL_NIL: {
-            asprintf(&chars, "nil");
+static void writeObject(Writer* writer, Obj* object) {
+    switch (object->type) {
+        case OBJ_STRING: {
+            writeCString(writer, "\"");
+            writeStringChars(writer, (ObjString*) object);
+            writeCString(writer, "\"");
             break;
         }
-        case VAL_BOOL: {
-            asprintf(&chars, AS_BOOL(value) ? "true" : "false");
+        case OBJ_CLOSURE: writeName(writer, "<", ((ObjClosure*) object)->function->name, ">"); break;
+        case OBJ_FUNCTION: writeName(writer, "<raw:", ((ObjFunction*) object)->name, ">"); break;
+        case OBJ_BOUND_METHOD: {
+            const ObjBoundMethod* boundMethod = (ObjBoundMethod*) object;
+            writeName(writer, "<bound:", boundMethod->method->function->name, ">");
             break;
         }
-
-        case VAL_OBJ: {
-            return objToString(AS_OBJ(value));
-        }
-
-        default: asprintf(&chars, "unrecognized value"); break;
+        case OBJ_ARRAY: writeArray(writer, (ObjArray*) object); break;
+        case OBJ_MODULE: writeName(writer, "<module:", ((ObjModule*) object)->path, ">"); break;
+        case OBJ_NATIVE: writeName(writer, "<native:", ((ObjNative*) object)->name, ">"); break;
+        case OBJ_FOREIGN: writeName(writer, "<foreign:", ((ObjForeign*) object)->name, ">"); break;
+        case OBJ_UPVALUE: writeCString(writer, "upvalue"); break;
+        case OBJ_CLASS: writeName(writer, "{class:", ((ObjClass*) object)->name, "}"); break;
+        case OBJ_INSTANCE: writeName(writer, "{", ((ObjInstance*) object)->klass->name, "}"); break;
+        default: writeCString(writer, "unrecognized object"); break;
     }
-    return chars;
 }
 
-ObjString* valueKey(Value value) {
-    // Returns an ObjString* which can be used as a key to uniquely represent a value in a table
-    char* valueString = valueToString(value);
-    char* returnString;
-    char* prefix;
+void writeValue(Writer* writer, Value value) {
     switch (value.type) {
-        case VAL_NIL: prefix = "NIL:"; break;
-        case VAL_NUMBER: prefix = "NUMBER:"; break;
-        case VAL_BOOL: prefix = "BOOL:"; break;
-        case VAL_OBJ: if (IS_STRING(value)) {prefix = ""; break;}
-
-        default: return NULL;
+        case VAL_NUMBER: {
+            char buffer[NUMBER_BUFFER_SIZE];
+            int length = formatNumber(AS_NUMBER(value), buffer);
+            writeChars(writer, buffer, length);
+            break;
+        }
+        case VAL_NIL: writeCString(writer, "nil"); break;
+        case VAL_BOOL: writeCString(writer, AS_BOOL(value) ? "true" : "false"); break;
+        case VAL_OBJ: writeObject(writer, AS_OBJ(value)); break;
+        default: writeCString(writer, "unrecognized value"); break;
     }
+}
 
-    asprintf(&returnString, "%s%s", prefix, valueString);
-    free(valueString);
-    return takeString(returnString, (int) strlen(returnString));
+char* valueToString(Value value) {
+    // The caller frees the result
+    Writer writer;
+    initWriter(&writer, NULL, 0, NULL);
+    writeValue(&writer, value);
+    writeChars(&writer, "", 1);
+    return writer.chars;
 }
 
 void printValue(Value value) {
-    char* chars = valueToString(value);
-    printf(chars);
-    free(chars);
+    char buffer[WRITER_BUFFER_SIZE];
+    Writer writer;
+    initWriter(&writer, buffer, WRITER_BUFFER_SIZE, stdout);
+    writeValue(&writer, value);
+    flushWriter(&writer);
 }
 
 bool objEqual(Obj* aPtr, Obj* bPtr) {
+    if (aPtr == bPtr) return true;
     if (aPtr->type != bPtr->type) return false;
 
     switch (aPtr->type) {
-        case OBJ_STRING: return aPtr == bPtr; // Reference equality now works because of interning
+        case OBJ_STRING: {
+            // Two symbols are only equal if they are the same object, data strings are not
+            // interned and need their characters compared
+            ObjString* a = (ObjString*) aPtr;
+            ObjString* b = (ObjString*) bPtr;
+            if (a->interned && b->interned) return false;
+            if (a->length != b->length) return false;
+            return memcmp(stringChars(a), stringChars(b), a->length) == 0;
+        }
         case OBJ_FUNCTION: return false; // May change later
         default: return false;
     }
@@ -5,6 +5,8 @@
 #ifndef clox_value_h
 #define clox_value_h
 
+#include <stdio.h>
+
 #include "common.h"
 
 typedef struct Obj Obj;
@@ -41,19 +43,43 @@ typedef struct {
 #define IS_OBJ(value) ((value).type == VAL_OBJ)
 
 typedef struct {
-    int capacity;
-    int count;
+    size_t capacity;
+    size_t count;
     Value* values;
 } ValueArray;
 
+// Largest count whose size in bytes still fits in a size_t
+#define VALUE_ARRAY_MAX (SIZE_MAX / sizeof(Value))
+
 void initValueArray(ValueArray* array);
-void initValueArrayCopy(ValueArray* array, Value* values, uint8_t count);
+void initValueArrayCopy(ValueArray* array, Value* values, size_t count);
 void writeValueArray(ValueArray* array, Value value);
+void reserveValueArray(ValueArray* array, size_t capacity);
+void shrinkValueArray(ValueArray* array);
 void freeValueArray(ValueArray* array);
 
+// Arrays nested deeper than this are written as [...]
+#define WRITER_MAX_DEPTH 64
+#define WRITER_BUFFER_SIZE 4096
+
+typedef struct {
+    // Values are formatted in one pass into chars. With a sink the buffer is fixed and flushed
+    // to it when full, without one it grows and holds the whole result
+    char* chars;
+    int length;
+    int capacity;
+    FILE* sink;
+    Obj* open[WRITER_MAX_DEPTH]; // Arrays currently being written, to cut off cycles
+    int depth;
+} Writer;
+
+void initWriter(Writer* writer, char* buffer, int capacity, FILE* sink);
+void writeChars(Writer* writer, const char* chars, int length);
+void writeValue(Writer* writer, Value value);
+void flushWriter(Writer* writer);
+
 void printValue(Value value);
-char* valueToString(Value value);
+char* valueToString(Value value); // Allocated with malloc()
 bool valuesEqual(Value a, Value b);
-ObjString* valueKey(Value value);
 
 #endif
\ No newline at end of file
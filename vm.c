@@ -4,11 +4,20 @@
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "debug.h"
 #include "compiler.h"
+#include "cache.h"
 #include "memory.h"
 #include "object.h"
+#include "number.h"
+#include "module.h"
+#include "hash.h"
+#include "stringlib.h"
+#include "arraylib.h"
+#include "natives.h"
+#include "foreign.h"
 
 VM vm;
 
@@ -18,7 +27,9 @@ void resetStack() {
     vm.openUpvalues = NULL;
 }
 
-static void runtimeError(const char* format, ...) {
+void runtimeError(const char* format, ...) {
+    // The error has to come after everything printed before it
+    flushOutput();
     va_list args;
     va_start(args, format);
     vfprintf(stderr, format, args);
@@ -27,12 +38,14 @@ static void runtimeError(const char* format, ...) {
 
     CallFrame* frame = &vm.frames[vm.frameCount - 1];
     size_t instruction = frame->ip - frame->closure->function->chunk.code - 1;
-    int line = frame->closure->function->chunk.lines[instruction];
+    int line = getLine(&frame->closure->function->chunk, (int) instruction);
     fprintf(stderr, "[line %d] in script\n", line);
     resetStack();
 }
 
 void initVM() {
+    // Before anything is interned
+    initHashSeed();
     resetStack();
     vm.objects = NULL;
 
@@ -42,16 +55,74 @@ void initVM() {
 
     vm.bytesAllocated = 0;
     vm.nextGC = 1024 * 1024;
+    vm.collecting = false;
 
     initTable(&vm.strings);
     initTable(&vm.globals);
+    initTable(&vm.modules);
+    initTable(&vm.stringMethods);
+    initTable(&vm.arrayMethods);
+    initTable(&vm.natives);
+    initTable(&vm.foreignFunctions);
+
+    vm.heapShared = false;
+    pthread_mutexattr_t attributes;
+    pthread_mutexattr_init(&attributes);
+    pthread_mutexattr_settype(&attributes, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&vm.heapLock, &attributes);
+    pthread_mutexattr_destroy(&attributes);
+
     vm.initString = copyString("init", 4);
+    initStringMethods();
+    initArrayMethods();
+    initNatives();
+    initForeign();
+
+    initWriter(&vm.output, malloc(OUTPUT_BUFFER_SIZE), OUTPUT_BUFFER_SIZE, stdout);
+#if defined(DEBUG_PRINT_CODE) || defined(DEBUG_TRACE_EXECUTION)
+    // Debug output goes through stdio, printed lines have to keep their place among it
+    vm.unbufferedOutput = true;
+#else
+    // Like stdio, a terminal sees each line as it is printed
+    vm.unbufferedOutput = isatty(STDOUT_FILENO);
+#endif
+}
+
+void defineNative(const char* name, NativeFn function, int arity) {
+    // Visible from every module, unless the module defines a global of the same name
+    ObjString* nameString = copyString((char*) name, (int) strlen(name));
+    push(OBJ_VAL(nameString));
+    push(OBJ_VAL(newNative(function, nameString, arity)));
+    tableSet(&vm.natives, nameString, vm.stackTop[-1]);
+    vm.stackTop -= 2;
+}
+
+void setOutputBuffer(int size) {
+    flushOutput();
+    free(vm.output.chars);
+    initWriter(&vm.output, malloc(size > 0 ? size : 1), size, stdout);
+}
+
+void setUnbufferedOutput(bool unbuffered) {
+    vm.unbufferedOutput = unbuffered;
+}
+
+void flushOutput() {
+    flushWriter(&vm.output);
 }
 
 void freeVM() {
+    flushOutput();
+    free(vm.output.chars);
     freeObjects();
     freeTable(&vm.strings);
     freeTable(&vm.globals);
+    freeTable(&vm.modules);
+    freeTable(&vm.stringMethods);
+    freeTable(&vm.arrayMethods);
+    freeTable(&vm.natives);
+    freeTable(&vm.foreignFunctions);
+    pthread_mutex_destroy(&vm.heapLock);
 }
 
 void push(Value value) {
@@ -77,38 +148,134 @@ static bool isFalsey(Value value) {
     return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
-void concatenate() {
-    Value aValue = peek(1);
-    Value bValue = peek(0);
-    ObjString* aString;
-    ObjString* bString;
+static const char* operandChars(Value value, char* buffer, int* length) {
+    // Numbers are formatted onto the caller's stack instead of becoming strings of their own.
+    // A rope gives NULL, it is always long enough to be shared rather than copied
+    if (IS_NUMBER(value)) {
+        *length = formatNumber(AS_NUMBER(value), buffer);
+        return buffer;
+    }
+    *length = AS_STRING(value)->length;
+    return AS_STRING(value)->chars;
+}
 
-    if (IS_NUMBER(aValue)) {
-        char* chars = valueToString(aValue);
-        aString = takeString(chars, (int) strlen(chars));
-    } else {
-        aString = AS_STRING(aValue);
+static ObjString* operandString(int distance, const char* chars, int length) {
+    // A rope needs both halves as strings, a number becomes one in its slot on the stack
+    Value value = peek(distance);
+    if (IS_STRING(value)) return AS_STRING(value);
+    ObjString* string = newDataString(length);
+    memcpy(string->chars, chars, length);
+    vm.stackTop[-1 - distance] = OBJ_VAL(string);
+    return string;
+}
+
+bool concatenate() {
+    char aBuffer[NUMBER_BUFFER_SIZE];
+    char bBuffer[NUMBER_BUFFER_SIZE];
+    int aLength;
+    int bLength;
+    const char* aChars = operandChars(peek(1), aBuffer, &aLength);
+    const char* bChars = operandChars(peek(0), bBuffer, &bLength);
+    if ((int64_t) aLength + bLength > STRING_MAX_LENGTH) {
+        runtimeError("Concatenated string is too long");
+        return false;
     }
 
-    if (IS_NUMBER(bValue)) {
-        char* chars = valueToString(bValue);
-        bString = takeString(chars, (int) strlen(chars));
+    // The result is a data string that is never hashed or looked up in vm.strings. Short ones
+    // are joined straight into their own allocation, long ones become a rope over the operands.
+    // Both operands stay on the stack while it is allocated
+    ObjString* result;
+    if (aLength + bLength >= ROPE_MIN_LENGTH) {
+        ObjString* left = operandString(1, aChars, aLength);
+        ObjString* right = operandString(0, bChars, bLength);
+        result = newRope(left, right);
     } else {
-        bString = AS_STRING(bValue);
+        result = newDataString(aLength + bLength);
+        memcpy(result->chars, aChars, aLength);
+        memcpy(result->chars + aLength, bChars, bLength);
     }
-
-    int length = aString->length + bString->length;
-    char* chars = ALLOCATE(char, length + 1);
-    memcpy(chars, aString->chars, aString->length);
-    memcpy(chars + aString->length, bString->chars, bString->length);
-    chars[length] = '\0';
-    ObjString* result = takeString(chars, length);
     pop();
     pop();
     push(OBJ_VAL(result));
+    return true;
+}
+
+static bool isLongString(Value value) {
+    return IS_STRING(value) && AS_STRING(value)->length >= ROPE_MIN_LENGTH;
+}
+
+static bool concatenateMany(int count) {
+    // Joins a whole '+' chain at once. Numbers are formatted into one buffer up front, so the
+    // result is sized and allocated once. A long string at either end is shared through a
+    // rope rather than copied, which keeps s = s + "..." + x linear
+    Value* operands = vm.stackTop - count;
+    char numbers[UINT8_MAX * NUMBER_BUFFER_SIZE];
+    int lengths[UINT8_MAX];
+    int numbersLength = 0;
+    int64_t totalLength = 0;
+    for (int i = 0; i < count; i++) {
+        if (IS_NUMBER(operands[i])) {
+            lengths[i] = formatNumber(AS_NUMBER(operands[i]), numbers + numbersLength);
+            numbersLength += lengths[i];
+        } else if (IS_STRING(operands[i])) {
+            lengths[i] = AS_STRING(operands[i])->length;
+        } else {
+            runtimeError("Can only add strings or numbers");
+            return false;
+        }
+        totalLength += lengths[i];
+    }
+    if (totalLength > STRING_MAX_LENGTH) {
+        runtimeError("Concatenated string is too long");
+        return false;
+    }
+
+    bool shareFirst = count > 2 && isLongString(operands[0]);
+    bool shareLast = count > 2 && isLongString(operands[count - 1]);
+    int first = shareFirst ? 1 : 0;
+    int last = shareLast ? count - 1 : count;
+    int length = 0;
+    for (int i = first; i < last; i++) {
+        // Flattening allocates, so it is done before any characters are copied
+        if (IS_STRING(operands[i])) stringChars(AS_STRING(operands[i]));
+        length += lengths[i];
+    }
+
+    ObjString* result = newDataString(length);
+    // Shared ends are always strings, so the numbers are all in the joined part
+    char* destination = result->chars;
+    const char* number = numbers;
+    for (int i = first; i < last; i++) {
+        if (IS_NUMBER(operands[i])) {
+            memcpy(destination, number, lengths[i]);
+            number += lengths[i];
+        } else {
+            memcpy(destination, AS_STRING(operands[i])->chars, lengths[i]);
+        }
+        destination += lengths[i];
+    }
+
+    // Each part stays in a stack slot while the ropes around it are allocated
+    operands[first] = OBJ_VAL(result);
+    if (shareFirst) {
+        result = newRope(AS_STRING(operands[0]), result);
+        operands[0] = OBJ_VAL(result);
+    }
+    if (shareLast) result = newRope(result, AS_STRING(operands[count - 1]));
+    vm.stackTop = operands;
+    push(OBJ_VAL(result));
+    return true;
 }
 
 bool addFrame(ObjClosure* closure, uint8_t argumentCount) {
+    ObjFunction* function = closure->function;
+    if (function->lazy != NULL) {
+        if (!compileLazyFunction(function)) {
+            runtimeError("Could not compile function body");
+            return false;
+        }
+        if (function->module != NULL) assignModule(function, function->module);
+    }
     if (argumentCount != closure->function->arity) {
         runtimeError("Incorrect number of arguments passed into function");
         return false;
@@ -117,6 +284,7 @@ bool addFrame(ObjClosure* closure, uint8_t argumentCount) {
     frame->closure = closure;
     frame->ip = closure->function->chunk.code;
     frame->slots = vm.stackTop - argumentCount - 1;
+    frame->globals = function->module == NULL ? &vm.globals : &function->module->globals;
     return true;
 }
 
@@ -163,6 +331,24 @@ static void closeUpvalue(Value* value) {
         }
 }
 
+static void createArray(size_t count) {
+    // The elements stay on the stack until the array holds them
+    ObjArray* array = newArray(vm.stackTop - count, count);
+    vm.stackTop -= count;
+    push(OBJ_VAL(array));
+}
+
+static bool arrayIndex(ObjArray* array, Value indexValue, size_t* index) {
+    // Checked as a double, so negative and huge indices are caught before any conversion
+    double number = AS_NUMBER(indexValue);
+    if (!(number >= 0 && number < (double) array->valueArray.count)) {
+        runtimeError("Provided index is out of bounds");
+        return false;
+    }
+    *index = (size_t) number;
+    return true;
+}
+
 static bool setProperty(Value instanceValue, ObjString* propertyName, Value value) {
     if (!IS_INSTANCE(instanceValue)) {
         runtimeError("Can only set property of instance");
@@ -195,8 +381,17 @@ static bool getProperty(Value instanceValue, ObjString* propertyName, Value* val
         return true;
     }
 
+    if (IS_STRING(instanceValue)) {
+        if (propertyName->length != 6 || memcmp(propertyName->chars, "length", 6) != 0) {
+            runtimeError("Can only access length property of string");
+            return false;
+        }
+        *value = NUMBER_VAL(AS_STRING(instanceValue)->length);
+        return true;
+    }
+
     if (!IS_INSTANCE(instanceValue)) {
-        runtimeError("Can only get property of instance or array");
+        runtimeError("Can only get property of instance, array or string");
         return false;
     }
 
@@ -217,8 +412,14 @@ static bool getProperty(Value instanceValue, ObjString* propertyName, Value* val
     return true;
 }
 
-static void defineMethod(ObjString* name) {
+static bool defineMethod(ObjString* name) {
+    // The compiler always emits a closure over its class, but cached bytecode is only checked
+    // for its stack shape, so the types are checked here
     Value method = peek(0);
+    if (!IS_CLASS(peek(1)) || !IS_CLOSURE(method)) {
+        runtimeError("Can only define methods on classes");
+        return false;
+    }
     ObjClass* klass = AS_CLASS(peek(1));
 
     if (name == vm.initString) {
@@ -227,11 +428,235 @@ static void defineMethod(ObjString* name) {
         tableSet(&klass->methods, name, method);
     }
     pop();
+    return true;
+}
+
+static bool defineGlobal(Table* globals, ObjString* identifier) {
+    tableSet(globals, identifier, peek(0));
+    pop();
+    return true;
+}
+
+static bool getGlobal(Table* globals, ObjString* identifier) {
+    Value value;
+    if (!tableGet(globals, identifier, &value) && !tableGet(&vm.natives, identifier, &value)) {
+        runtimeError("Undefined variable '%s'", identifier->chars);
+        return false;
+    }
+    push(value);
+    return true;
+}
+
+static bool setGlobal(Table* globals, ObjString* identifier) {
+    // Must already be defined
+    if (!tableGet(globals, identifier, NULL)) {
+        runtimeError("Undefined variable '%s'", identifier->chars);
+        return false;
+    }
+    tableSet(globals, identifier, peek(0)); // Left on stack
+    return true;
+}
+
+static void makeClosure(CallFrame* frame, ObjFunction* function) {
+    push(OBJ_VAL(function));
+    ObjClosure* closure = newClosure(function);
+    pop();
+    push(OBJ_VAL(closure));
+    for (int i = 0; i < closure->upvalueCount; i++) {
+        // Bit 0 marks a local of the enclosing function, bit 1 a 24 bit index
+        uint8_t flags = *frame->ip++;
+        int index = *frame->ip++;
+        if (flags & 2) {
+            index = index << 16 | frame->ip[0] << 8 | frame->ip[1];
+            frame->ip += 2;
+        }
+        ObjUpvalue* upvalue;
+        if (flags & 1) {
+            upvalue = captureUpvalue(frame->slots + index);
+        } else {
+            upvalue = frame->closure->upvalues[index];
+        }
+        closure->upvalues[i] = upvalue;
+    }
+}
+
+static bool callNative(ObjNative* native, int argumentCount) {
+    if (native->arity != NATIVE_VARIADIC && argumentCount != native->arity) {
+        runtimeError("Incorrect number of arguments passed into %s", native->name->chars);
+        return false;
+    }
+    // No frame is pushed. The native reads its arguments where they are, the result replaces
+    // the callee
+    Value* arguments = vm.stackTop - argumentCount;
+    Value result;
+    if (!native->function(argumentCount, arguments, &result)) return false;
+    vm.stackTop = arguments;
+    vm.stackTop[-1] = result;
+    return true;
+}
+
+static bool invoke(ObjString* methodName, uint8_t argumentCount) {
+    Value receiver = peek(argumentCount);
+    if (IS_STRING(receiver)) return invokeStringMethod(methodName, argumentCount);
+    if (IS_ARRAY(receiver)) return invokeArrayMethod(methodName, argumentCount);
+    if (!IS_INSTANCE(receiver)) {
+        runtimeError("Can only call methods on instances, strings and arrays");
+        return false;
+    }
+    ObjInstance* instance = AS_INSTANCE(receiver);
+    Value methodValue;
+    if (!tableGet(&instance->klass->methods, methodName, &methodValue)) {
+        // Check if callable attribute exists
+        if (!tableGet(&instance->fields, methodName, &methodValue)) {
+            runtimeError("Method / function field does not exist");
+            return false;
+        }
+
+        vm.stackTop[-argumentCount - 1] = methodValue;
+        if (IS_NATIVE(methodValue)) return callNative(AS_NATIVE(methodValue), argumentCount);
+        if (IS_FOREIGN(methodValue)) return callForeign(AS_FOREIGN(methodValue), argumentCount);
+    } else {
+        vm.stackTop[-argumentCount - 1] = OBJ_VAL(instance);
+    }
+
+    ObjClosure* closure = AS_CLOSURE(methodValue);
+    return addFrame(closure, argumentCount);
+}
+
+static InterpretResult run(int baseFrame);
+
+bool callFunction(int argumentCount) {
+    // Calls back into Lox from C. The callee and its arguments are on the stack, they are
+    // replaced by the result once the call has run to completion in a nested run()
+    Value callee = vm.stackTop[-1 - argumentCount];
+    if (IS_NATIVE(callee)) return callNative(AS_NATIVE(callee), argumentCount);
+    if (IS_FOREIGN(callee)) return callForeign(AS_FOREIGN(callee), argumentCount);
+
+    ObjClosure* closure;
+    if (IS_CLOSURE(callee)) {
+        closure = AS_CLOSURE(callee);
+    } else if (IS_BOUND_METHOD(callee)) {
+        vm.stackTop[-1 - argumentCount] = AS_BOUND_METHOD(callee)->receiver;
+        closure = AS_BOUND_METHOD(callee)->method;
+    } else {
+        runtimeError("Can only call functions and methods");
+        return false;
+    }
+    if (vm.frameCount == FRAMES_MAX) {
+        runtimeError("Stack overflow");
+        return false;
+    }
+    if (!addFrame(closure, argumentCount)) return false;
+    return run(vm.frameCount - 1) == INTERPRET_OK;
+}
+
+static bool getSuper(ObjString* methodName) {
+    // [this][super]
+    Value instanceValue = peek(1);
+    if (!IS_CLASS(peek(0))) {
+        runtimeError("Superclass must be a class");
+        return false;
+    }
+    ObjClass* superclass = AS_CLASS(peek(0));
+    Value methodValue;
+    if (!tableGet(&superclass->methods, methodName, &methodValue)) {
+        runtimeError("Superclass does not have method: %s", methodName->chars);
+        return false;
+    }
+    ObjBoundMethod* boundMethod = newBoundMethod(instanceValue, AS_CLOSURE(methodValue));
+    popCount(2);
+    push(OBJ_VAL(boundMethod));
+    return true;
+}
+
+static bool superInvoke(ObjString* methodName, uint8_t argumentCount) {
+    //[this][x][y]...[super]
+    if (!IS_CLASS(peek(0))) {
+        runtimeError("Superclass must be a class");
+        return false;
+    }
+    ObjClass* superclass = AS_CLASS(pop());
+    Value methodValue;
+    if (!tableGet(&superclass->methods, methodName, &methodValue)) {
+        runtimeError("Superclass does not have method: %s", methodName->chars);
+        return false;
+    }
+    return addFrame(AS_CLOSURE(methodValue), argumentCount);
+}
+
+static bool importModule(CallFrame* frame, ObjString* path) {
+    ObjModule* module = findModule(frame->closure->function->module, path);
+    if (module == NULL) {
+        runtimeError("Could not load module '%s'", path->chars);
+        return false;
+    }
+
+    // A module runs once, an import cycle sees whatever it has defined so far
+    if (module->state == MODULE_LOADED) {
+        module->state = MODULE_RUNNING;
+        push(OBJ_VAL((Obj*) module->function));
+        ObjClosure* closure = newClosure(module->function);
+        pop();
+        push(OBJ_VAL(closure));
+        if (!addFrame(closure, 0)) return false;
+        if (run(vm.frameCount - 1) != INTERPRET_OK) return false;
+        pop(); // Implicit nil the module returns
+        module->state = MODULE_DONE;
+    }
+
+    // Copied by value, every import binds to the module's globals as they are right now
+    tableAddAll(&module->globals, frame->globals);
+    return true;
 }
 
-InterpretResult run() {
+static bool runWide(CallFrame* frame, uint8_t instruction, uint32_t operand) {
+    // Operands too large for one byte, kept out of run() so the compact cases stay small
+    Value* constants = frame->closure->function->chunk.constants.values;
+    switch (instruction) {
+        case OP_DEFINE_GLOBAL: return defineGlobal(frame->globals, AS_STRING(constants[operand]));
+        case OP_GET_GLOBAL: return getGlobal(frame->globals, AS_STRING(constants[operand]));
+        case OP_SET_GLOBAL: return setGlobal(frame->globals, AS_STRING(constants[operand]));
+        case OP_GET_LOCAL: push(frame->slots[operand]); return true;
+        case OP_SET_LOCAL: frame->slots[operand] = peek(0); return true;
+        case OP_JUMP_IF_FALSE: if (isFalsey(peek(0))) frame->ip += operand; return true;
+        case OP_JUMP: frame->ip += operand; return true;
+        case OP_LOOP: frame->ip -= operand; return true;
+        case OP_DUPLICATE: push(peek((int) operand)); return true;
+        case OP_CLOSURE: makeClosure(frame, AS_FUNCTION(constants[operand])); return true;
+        case OP_GET_UPVALUE: push(*frame->closure->upvalues[operand]->location); return true;
+        case OP_SET_UPVALUE: *frame->closure->upvalues[operand]->location = peek(0); return true;
+        case OP_CLASS: push(OBJ_VAL(newClass(AS_STRING(constants[operand])))); return true;
+        case OP_CREATE_ARRAY: createArray(operand); return true;
+        case OP_GET_PROPERTY: {
+            Value value;
+            if (!getProperty(peek(0), AS_STRING(constants[operand]), &value)) return false;
+            vm.stackTop[-1] = value;
+            return true;
+        }
+        case OP_SET_PROPERTY: {
+            Value value = peek(0);
+            if (!setProperty(peek(1), AS_STRING(constants[operand]), value)) return false;
+            vm.stackTop -= 2;
+            push(value);
+            return true;
+        }
+        case OP_METHOD: return defineMethod(AS_STRING(constants[operand]));
+        case OP_INVOKE: return invoke(AS_STRING(constants[operand]), *frame->ip++);
+        case OP_GET_SUPER: return getSuper(AS_STRING(constants[operand]));
+        case OP_SUPER_INVOKE: return superInvoke(AS_STRING(constants[operand]), *frame->ip++);
+        case OP_IMPORT: return importModule(frame, AS_STRING(constants[operand]));
+        default: {
+            runtimeError("Unrecognized wide instruction");
+            return false;
+        }
+    }
+}
+
+static InterpretResult run(int baseFrame) {
 #define READ_BYTE() (*frame->ip++)
 #define READ_SHORT() (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
+#define READ_WIDE() (frame->ip += 3, \
+    (uint32_t)((frame->ip[-3] << 16) | (frame->ip[-2] << 8) | frame->ip[-1]))
 #define READ_CONSTANT() (frame->closure->function->chunk.constants.values[READ_BYTE()])
 #define READ_STRING() AS_STRING(READ_CONSTANT())
 #define IS_ADDABLE(value) (IS_STRING(value) || IS_NUMBER(value))
@@ -262,11 +687,17 @@ InterpretResult run() {
         uint8_t instruction;
         switch (instruction = READ_BYTE()) {
             case OP_RETURN: {
-                if (vm.frameCount == 1) return INTERPRET_OK;
+                if (vm.frameCount == 1) {
+                    // Leaves an empty stack for the next line of the REPL
+                    popFrame();
+                    return INTERPRET_OK;
+                }
                 Value value = pop();
                 closeUpvalue(frame->slots);
                 popFrame();
                 push(value);
+                // A nested run() for an import ends with the module's own frame
+                if (vm.frameCount == baseFrame) return INTERPRET_OK;
                 break;
             }
             case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -); break;
@@ -282,11 +713,12 @@ InterpretResult run() {
             case OP_ADD: {
                 if (!IS_ADDABLE(peek(0)) || !IS_ADDABLE(peek(1))) {
                     runtimeError("Can only add strings or numbers");
+                    return INTERPRET_RUNTIME_ERROR;
                 }
 
 
                 if (IS_STRING(peek(0)) || IS_STRING(peek(1))) {
-                    concatenate();
+                    if (!concatenate()) return INTERPRET_RUNTIME_ERROR;
                     break;
                 }
 
@@ -294,6 +726,20 @@ InterpretResult run() {
                 break;
             }
 
+            case OP_CONCAT_N: {
+                if (!concatenateMany(READ_BYTE())) return INTERPRET_RUNTIME_ERROR;
+                break;
+            }
+
+            case OP_CHECK_ADDABLE: {
+                Value operand = peek(READ_BYTE());
+                if (!IS_ADDABLE(operand)) {
+                    runtimeError("Can only add strings or numbers");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                break;
+            }
+
             case OP_NEGATE: {
                 if (!IS_NUMBER(peek(0))) {
                     runtimeError("Operand must be number");
@@ -309,34 +755,31 @@ InterpretResult run() {
                 break;
             }
 
+            case OP_CONSTANT_LONG: {
+                Value constant = frame->closure->function->chunk.constants.values[READ_WIDE()];
+                push(constant);
+                break;
+            }
+
+            case OP_WIDE: {
+                uint8_t wideInstruction = READ_BYTE();
+                uint32_t operand = READ_WIDE();
+                if (!runWide(frame, wideInstruction, operand)) return INTERPRET_RUNTIME_ERROR;
+                break;
+            }
+
             case OP_DEFINE_GLOBAL: {
-                ObjString* identifier = READ_STRING();
-                tableSet(&vm.globals, identifier, peek(0));
-                pop();
+                defineGlobal(frame->globals, READ_STRING());
                 break;
             }
 
             case OP_GET_GLOBAL: {
-                ObjString* identifier = READ_STRING();
-                Value value;
-                bool globalExists = tableGet(&vm.globals, identifier, &value);
-                if (globalExists) {
-                    push(value);
-                } else {
-                    runtimeError("Undefined variable '%s'", identifier->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
+                if (!getGlobal(frame->globals, READ_STRING())) return INTERPRET_RUNTIME_ERROR;
                 break;
             }
 
             case OP_SET_GLOBAL : {
-                // Must already be defined
-                ObjString* identifier = READ_STRING();
-                if (!tableGet(&vm.globals, identifier, NULL)) {
-                    runtimeError("Undefined variable '%s'", identifier->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                tableSet(&vm.globals, identifier, peek(0)); // Left on stack
+                if (!setGlobal(frame->globals, READ_STRING())) return INTERPRET_RUNTIME_ERROR;
                 break;
             }
 
@@ -353,15 +796,18 @@ InterpretResult run() {
             }
 
             case OP_EQUAL: {
-                Value a = pop();
-                Value b = pop();
-                push(BOOL_VAL(valuesEqual(a, b)));
+                // Comparing ropes flattens them, so both stay on the stack until it is done
+                bool equal = valuesEqual(peek(0), peek(1));
+                vm.stackTop -= 2;
+                push(BOOL_VAL(equal));
                 break;
             }
 
             case OP_PRINT: {
-                printValue(pop());
-                printf("\n");
+                // Formatting does not allocate, so the value can leave the stack first
+                writeValue(&vm.output, pop());
+                writeChars(&vm.output, "\n", 1);
+                if (vm.unbufferedOutput) flushOutput();
                 break;
             }
 
@@ -441,6 +887,16 @@ InterpretResult run() {
                         break;
                     }
 
+                    case OBJ_NATIVE: {
+                        if (!callNative((ObjNative*) callable, argumentCount)) return INTERPRET_RUNTIME_ERROR;
+                        break;
+                    }
+
+                    case OBJ_FOREIGN: {
+                        if (!callForeign((ObjForeign*) callable, argumentCount)) return INTERPRET_RUNTIME_ERROR;
+                        break;
+                    }
+
                     default: {
                         runtimeError("Can only call functions, methods or classes");
                         return INTERPRET_RUNTIME_ERROR;
@@ -449,28 +905,24 @@ InterpretResult run() {
                 break;
             }
 
-            case OP_CREATE_ARRAY: {
-                uint8_t count = READ_BYTE();
-                vm.stackTop -= count;
-                ObjArray* array = newArray(vm.stackTop, count);
-                push(OBJ_VAL(array));
-                break;
-            }
+            case OP_CREATE_ARRAY: createArray(READ_BYTE()); break;
 
             case OP_GET_ARRAY: {
-                Value indexValue = pop();
-
-                if (IS_STRING(indexValue)) {
-                    Value instanceValue = pop();
-                    ObjString* propertyName = AS_STRING(indexValue);
+                if (IS_STRING(peek(0))) {
+                    // A name built at runtime is only reachable from the stack, so the operands
+                    // stay there until the lookup is done
+                    ObjString* propertyName = internString(AS_STRING(peek(0)));
+                    vm.stackTop[-1] = OBJ_VAL(propertyName); // A slice interns as a new copy
                     Value value;
-                    if (!getProperty(instanceValue, propertyName, &value)) {
+                    if (!getProperty(peek(1), propertyName, &value)) {
                         return INTERPRET_RUNTIME_ERROR;
                     }
+                    vm.stackTop -= 2;
                     push(value);
                     break;
                 }
 
+                Value indexValue = pop();
                 if (!IS_NUMBER(indexValue)) {
                     runtimeError("Index must be a number");
                     return INTERPRET_RUNTIME_ERROR;
@@ -480,31 +932,29 @@ InterpretResult run() {
                     runtimeError("Can only index into arrays");
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                int index = AS_NUMBER(indexValue);
                 ObjArray* array = AS_ARRAY(arrayValue);
-                if (index >= array->valueArray.count) {
-                    runtimeError("Provided index is out of bounds");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
+                size_t index;
+                if (!arrayIndex(array, indexValue, &index)) return INTERPRET_RUNTIME_ERROR;
                 push(array->valueArray.values[index]);
                 break;
             }
 
             case OP_SET_ARRAY: {
-                Value newValue = pop();
-                Value indexValue = pop();
-
-                if (IS_STRING(indexValue)) {
+                if (IS_STRING(peek(1))) {
                     // Field access
-                    Value instanceValue = pop();
-                    ObjString* propertyName = AS_STRING(indexValue);
-                    if (!setProperty(instanceValue, propertyName, newValue)) {
+                    ObjString* propertyName = internString(AS_STRING(peek(1)));
+                    vm.stackTop[-2] = OBJ_VAL(propertyName);
+                    Value newValue = peek(0);
+                    if (!setProperty(peek(2), propertyName, newValue)) {
                         return INTERPRET_RUNTIME_ERROR;
                     }
+                    vm.stackTop -= 3;
                     push(newValue);
                     break;
                 }
 
+                Value newValue = pop();
+                Value indexValue = pop();
                 if (!IS_NUMBER(indexValue)) {
                     runtimeError("Index must be a number");
                     return INTERPRET_RUNTIME_ERROR;
@@ -514,8 +964,9 @@ InterpretResult run() {
                     runtimeError("Can only index into arrays");
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                int index = AS_NUMBER(indexValue);
                 ObjArray* array = AS_ARRAY(arrayValue);
+                size_t index;
+                if (!arrayIndex(array, indexValue, &index)) return INTERPRET_RUNTIME_ERROR;
                 array->valueArray.values[index] = newValue;
                 push(newValue);
                 break;
@@ -528,34 +979,20 @@ InterpretResult run() {
             }
 
             case OP_APPEND: {
-                Value value = pop();
-                Value arrayValue = peek(0);
+                Value arrayValue = peek(1);
                 if (!IS_ARRAY(arrayValue)) {
                     runtimeError("Can only append to arrays");
                     return INTERPRET_RUNTIME_ERROR;
                 }
+                // Popped only once stored, growing the array can collect garbage
                 ObjArray* array = AS_ARRAY(arrayValue);
-                writeValueArray(&array->valueArray, value);
+                writeValueArray(&array->valueArray, peek(0));
+                pop();
                 break;
             }
 
             case OP_CLOSURE: {
-                ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
-                push(OBJ_VAL(function));
-                ObjClosure* closure = newClosure(function);
-                pop();
-                push(OBJ_VAL(closure));
-                for (int i = 0; i < closure->upvalueCount; i++) {
-                    bool isLocal = READ_BYTE() == 1;
-                    uint8_t index = READ_BYTE();
-                    ObjUpvalue* upvalue;
-                    if (isLocal) {
-                        upvalue = captureUpvalue(frame->slots + index);
-                    } else {
-                        upvalue = frame->closure->upvalues[index];
-                    }
-                    closure->upvalues[i] = upvalue;
-                }
+                makeClosure(frame, AS_FUNCTION(READ_CONSTANT()));
                 break;
             }
 
@@ -585,53 +1022,35 @@ InterpretResult run() {
             }
 
             case OP_GET_PROPERTY: {
+                // The receiver stays on the stack while a bound method is allocated
                 ObjString* propertyName = READ_STRING();
-                Value instanceValue = pop();
                 Value value;
-                if (!getProperty(instanceValue, propertyName, &value)) {
+                if (!getProperty(peek(0), propertyName, &value)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                push(value);
+                vm.stackTop[-1] = value;
                 break;
             }
 
             case OP_SET_PROPERTY: {
                 ObjString* propertyName = READ_STRING();
-                Value value = pop();
-                Value instanceValue = pop();
-                if (!setProperty(instanceValue, propertyName, value)) {
+                Value value = peek(0);
+                if (!setProperty(peek(1), propertyName, value)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
+                vm.stackTop -= 2;
                 push(value);
                 break;
             }
 
             case OP_METHOD: {
-                defineMethod(READ_STRING());
+                if (!defineMethod(READ_STRING())) return INTERPRET_RUNTIME_ERROR;
                 break;
             }
 
             case OP_INVOKE: {
                 ObjString* methodName = READ_STRING();
-                uint8_t argumentCount = READ_BYTE();
-
-                ObjInstance* instance = AS_INSTANCE(peek(argumentCount));
-                Value methodValue;
-                if (!tableGet(&instance->klass->methods, methodName, &methodValue)) {
-                    // Check if callable attribute exists
-                    if (!tableGet(&instance->fields, methodName, &methodValue)) {
-                        runtimeError("Method / function field does not exist");
-                        return INTERPRET_RUNTIME_ERROR;
-                    }
-
-                    vm.stackTop[-argumentCount - 1] = methodValue;
-                } else {
-                    vm.stackTop[-argumentCount - 1] = OBJ_VAL(instance);
-                }
-
-                ObjClosure* closure = AS_CLOSURE(methodValue);
-                if (!addFrame(closure, argumentCount)) return INTERPRET_RUNTIME_ERROR;
-
+                if (!invoke(methodName, READ_BYTE())) return INTERPRET_RUNTIME_ERROR;
                 break;
             }
 
@@ -641,6 +1060,10 @@ InterpretResult run() {
                     runtimeError("Can only inherit from another class");
                     return INTERPRET_RUNTIME_ERROR;
                 }
+                if (!IS_CLASS(peek(0))) {
+                    runtimeError("Can only inherit into a class");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
                 ObjClass* superclass = AS_CLASS(superclassValue);
                 ObjClass* subclass = AS_CLASS(peek(0));
 
@@ -650,31 +1073,18 @@ InterpretResult run() {
             }
 
             case OP_GET_SUPER: {
-                // [this][super]
-                Value instanceValue = peek(1);
-                ObjClass* superclass = AS_CLASS(peek(0));
-                ObjString* methodName = READ_STRING();
-                Value methodValue;
-                if (!tableGet(&superclass->methods, methodName, &methodValue)) {
-                    runtimeError("Superclass does not have method: %s", methodName);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                ObjBoundMethod* boundMethod = newBoundMethod(instanceValue, AS_CLOSURE(methodValue));
-                popCount(2);
-                push(OBJ_VAL(boundMethod));
+                if (!getSuper(READ_STRING())) return INTERPRET_RUNTIME_ERROR;
                 break;
             }
 
             case OP_SUPER_INVOKE: {
-                //[this][x][y]...[super]
-                ObjClass* superclass = AS_CLASS(pop());
                 ObjString* methodName = READ_STRING();
-                Value methodValue;
-                if (!tableGet(&superclass->methods, methodName, &methodValue)) {
-                    runtimeError("Superclass does not have method: %s", methodName);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                addFrame(AS_CLOSURE(methodValue), READ_BYTE());
+                if (!superInvoke(methodName, READ_BYTE())) return INTERPRET_RUNTIME_ERROR;
+                break;
+            }
+
+            case OP_IMPORT: {
+                if (!importModule(frame, READ_STRING())) return INTERPRET_RUNTIME_ERROR;
                 break;
             }
 
@@ -687,15 +1097,21 @@ InterpretResult run() {
 #undef READ_CONSTANT
 #undef READ_BYTE
 #undef READ_SHORT
+#undef READ_WIDE
 #undef READ_STRING
 #undef BINARY_OP
 }
 
-InterpretResult interpret(const char* source) {
+static InterpretResult interpretModule(ObjModule* module, const char* source) {
+    // Imports compile on worker threads while this thread compiles the script itself
+    beginImports(module, source);
+    ObjFunction* function = loadFunction(source);
+    endImports();
+    if (function == NULL) return INTERPRET_COMPILE_ERROR;
+    if (module != NULL) assignModule(function, module);
+
     // Wrap function in a closure:
-    ObjFunction* function = compile(source);
     push(OBJ_VAL((Obj*)function));
-    if (function == NULL) return INTERPRET_COMPILE_ERROR;
     ObjClosure* closure = newClosure(function);
     pop();
 
@@ -704,17 +1120,27 @@ InterpretResult interpret(const char* source) {
     push(OBJ_VAL(closure));
     addFrame(closure, 0);
 
-    return run();
+    return run(0);
 }
 
-void printObjects() {
-    // Needs to be fixed
-    Obj* ptr = vm.objects;
-    while (ptr != NULL) {
-        ObjString* string = (ObjString*) ptr;
-        printf("%s -> ", string->chars);
-        ptr = ptr->next;
-    }
-    printf("NULL");
+InterpretResult interpret(const char* source) {
+    return interpretModule(NULL, source);
 }
 
+InterpretResult interpretFile(const char* path, const char* source) {
+    // The script is a module too, so an import cycle back to it does not run it twice. A
+    // script read from standard input keeps "-" as its path, so a file named "-" is not it
+    char* canonicalPath = strcmp(path, "-") == 0 ? NULL : realpath(path, NULL);
+    const char* key = canonicalPath == NULL ? path : canonicalPath;
+    ObjString* modulePath = copyString((char*) key, (int) strlen(key));
+    free(canonicalPath);
+    push(OBJ_VAL(modulePath));
+    ObjModule* module = newModule(modulePath);
+    push(OBJ_VAL(module));
+    tableSet(&vm.modules, module->path, OBJ_VAL(module));
+    pop();
+    pop();
+    module->state = MODULE_RUNNING;
+
+    return interpretModule(module, source);
+}
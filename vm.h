@@ -5,6 +5,8 @@
 #ifndef clox_vm_h
 #define clox_vm_h
 
+#include <pthread.h>
+
 #include "chunk.h"
 #include "value.h"
 #include "table.h"
@@ -18,11 +20,13 @@ typedef enum {
 
 #define FRAMES_MAX 64
 #define STACK_MAX (256 * UINT8_COUNT)
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
 
 typedef struct {
     ObjClosure* closure;
     uint8_t* ip;
     Value* slots;
+    Table* globals; // Namespace of the module the function was compiled in
 } CallFrame;
 
 typedef struct {
@@ -33,7 +37,8 @@ typedef struct {
     Value* stackTop;
     Obj* objects;
     Table strings;
-    Table globals;
+    Table globals; // Used by code without a module, i.e. the REPL
+    Table modules; // Canonical path -> ObjModule, each module is loaded once
     ObjUpvalue* openUpvalues;
 
     int grayCount;
@@ -42,8 +47,20 @@ typedef struct {
 
     size_t bytesAllocated;
     size_t nextGC;
+    bool collecting; // Allocations made by the collector itself do not start another collection
 
     ObjString* initString;
+    Table stringMethods; // Method name -> index of the built in string method
+    Table arrayMethods; // Method name -> index of the built in array method
+    Table natives; // Name -> ObjNative, looked up when a module's globals do not have the name
+    Table foreignFunctions; // "library symbol signature" -> ObjForeign, each is bound once
+
+    Writer output; // What print writes to stdout, flushed when full and at the flush points
+    bool unbufferedOutput; // Flush after every print
+
+    // Set while worker threads compile modules, every heap change then takes heapLock
+    bool heapShared;
+    pthread_mutex_t heapLock;
 } VM;
 
 extern VM vm;
@@ -51,8 +68,15 @@ extern VM vm;
 void initVM();
 void freeVM();
 InterpretResult interpret(const char* source);
+InterpretResult interpretFile(const char* path, const char* source);
 void push(Value value);
 Value pop();
+void runtimeError(const char* format, ...);
+void defineNative(const char* name, NativeFn function, int arity);
+bool callFunction(int argumentCount);
+void setOutputBuffer(int size);
+void setUnbufferedOutput(bool unbuffered);
+void flushOutput();
 
 void printObjects();
 